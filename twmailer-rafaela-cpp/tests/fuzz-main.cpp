@@ -0,0 +1,220 @@
+// Standalone driver for the fuzz targets when libFuzzer is not available (GCC builds).
+// Accepts the libFuzzer options used by make fuzz:
+//
+//     fuzz-<target> [-runs=<n>] [-seed=<n>] [-max_len=<bytes>] [<file or directory>]...
+//
+// Every file given, or found in a given directory, is run once; then <n> inputs are made
+// by mutating them with byte flips, insertions of protocol tokens, replaced numbers,
+// erasures, duplicated ranges and splices. A sanitizer report or a failed check aborts the process; an input
+// that takes longer than INPUT_TIMEOUT_S seconds is killed by SIGALRM. The seed printed at
+// the start reproduces the same inputs.
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INPUT_TIMEOUT_S 10   // Longest one input may run
+#define DEFAULT_RUNS 10000   // Mutated inputs without -runs
+#define DEFAULT_MAX_LEN 4096 // Longest mutated input without -max_len
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) __attribute__((weak));
+
+// Pieces of the protocol and of the stored message format, inserted by the mutator
+static const char *const tokens[] = {
+    "SEND\n", "SEND 1\n", "LIST\n", "READ\n", "DEL\n", "SEARCH\n", "SYNC\n", "QUOTA\n", "QUIT\n", "REPLICATE\n",
+    "\n", ".\n", "\\n", "\\", "#", "#0", "#4294967296", "-1", "0", "1", "18446744073709551616",
+    "Sender: ", "Receiver: ", "Subject: ", "Message: ", "from:", "subject:", "body:", "alice\n", "bob\n",
+    "../", "\t", " ", "\xc3\xa4", "\xff",
+};
+
+// Replacements for numbers in the input: message numbers, IDs, TTLs and counts at their limits
+static const char *const numbers[] = {
+    "", "0", "1", "2", "-1", "+1", "00", "65", "4294967295", "4294967296", "9223372036854775808", "18446744073709551616",
+};
+
+static bool readFile(const std::string &path, std::string &content)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    std::ostringstream stream;
+    stream << file.rdbuf();
+    content = stream.str();
+    return true;
+}
+
+// Collects the files of a corpus argument: the file itself or the regular files of a directory
+static void collect(const std::string &path, std::vector<std::string> &corpus)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        fprintf(stderr, "fuzz: cannot open %s\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    std::string content;
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (readFile(path, content))
+        {
+            corpus.push_back(content);
+        }
+        return;
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+    {
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end()); // Same order, and so the same inputs, for a seed
+    for (const std::string &name : names)
+    {
+        if (stat((path + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode) && readFile(path + "/" + name, content))
+        {
+            corpus.push_back(content);
+        }
+    }
+}
+
+static void mutate(std::string &input, const std::vector<std::string> &corpus, std::mt19937 &random, size_t maxLength)
+{
+    unsigned mutations = 1 + random() % 4;
+    for (unsigned i = 0; i < mutations; i++)
+    {
+        size_t position = input.empty() ? 0 : random() % (input.size() + 1);
+        switch (random() % 7)
+        {
+        case 0: // Flip a byte
+            if (!input.empty())
+            {
+                input[position % input.size()] ^= static_cast<char>(1 + random() % 255);
+            }
+            break;
+        case 1: // Insert random bytes
+            input.insert(position, std::string(1 + random() % 8, static_cast<char>(random())));
+            break;
+        case 2: // Insert a protocol token
+            input.insert(position, tokens[random() % (sizeof(tokens) / sizeof(tokens[0]))]);
+            break;
+        case 3: // Replace the next number with a boundary value
+        {
+            size_t start = input.find_first_of("0123456789", position);
+            if (start != std::string::npos)
+            {
+                size_t end = input.find_first_not_of("0123456789", start);
+                input.replace(start, end == std::string::npos ? std::string::npos : end - start,
+                              numbers[random() % (sizeof(numbers) / sizeof(numbers[0]))]);
+            }
+            break;
+        }
+        case 4: // Erase a range
+            if (!input.empty())
+            {
+                input.erase(position % input.size(), 1 + random() % 16);
+            }
+            break;
+        case 5: // Repeat a range, e.g. a whole command
+            if (!input.empty())
+            {
+                size_t start = position % input.size();
+                std::string range = input.substr(start, 1 + random() % 64);
+                input.insert(start, range);
+            }
+            break;
+        default: // Splice in part of another input
+            if (!corpus.empty())
+            {
+                const std::string &other = corpus[random() % corpus.size()];
+                size_t start = other.empty() ? 0 : random() % other.size();
+                input.insert(position, other.substr(start, random() % (other.size() - start + 1)));
+            }
+            break;
+        }
+    }
+    if (input.size() > maxLength)
+    {
+        input.resize(maxLength);
+    }
+}
+
+static void run(const std::string &input)
+{
+    alarm(INPUT_TIMEOUT_S);
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+    alarm(0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (LLVMFuzzerInitialize)
+    {
+        LLVMFuzzerInitialize(&argc, &argv);
+    }
+
+    unsigned long runs = DEFAULT_RUNS;
+    unsigned long seed = std::random_device()();
+    size_t maxLength = DEFAULT_MAX_LEN;
+    std::vector<std::string> corpus;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 6, "-runs=") == 0)
+        {
+            runs = strtoul(arg.c_str() + 6, nullptr, 10);
+        }
+        else if (arg.compare(0, 6, "-seed=") == 0)
+        {
+            seed = strtoul(arg.c_str() + 6, nullptr, 10);
+        }
+        else if (arg.compare(0, 9, "-max_len=") == 0)
+        {
+            maxLength = strtoul(arg.c_str() + 9, nullptr, 10);
+        }
+        else if (arg[0] == '-')
+        {
+            fprintf(stderr, "fuzz: ignoring option %s\n", arg.c_str());
+        }
+        else
+        {
+            collect(arg, corpus);
+        }
+    }
+
+    fprintf(stderr, "fuzz: %zu corpus inputs, %lu runs, -seed=%lu\n", corpus.size(), runs, seed);
+    for (const std::string &input : corpus)
+    {
+        run(input);
+    }
+
+    std::mt19937 random(seed);
+    for (unsigned long i = 0; i < runs; i++)
+    {
+        std::string input = corpus.empty() ? std::string() : corpus[random() % corpus.size()];
+        mutate(input, corpus, random, maxLength);
+        run(input);
+    }
+    fprintf(stderr, "fuzz: done, %zu inputs without a failure\n", corpus.size() + runs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+// Fuzz target for the command parser of the server: every input is the byte stream of one
+// client session, served by an in-process server over a socketpair. The session has to end
+// once the input is used up, without a sanitizer report; a hang is caught by the driver's
+// timeout. The spool is a temporary directory that is removed at exit.
+#include "../twmailer-server.h"
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+
+#define FUZZ_MAX_INPUT 262144 // Longer inputs are cut
+#define MAX_MESSAGES 64         // Quota of every mailbox, so the spool stays small over many runs
+
+static Server *server = nullptr;
+static char spool[] = "/tmp/twmailer-fuzz-XXXXXX";
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+    return remove(path);
+}
+
+static void cleanup()
+{
+    delete server;
+    nftw(spool, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***)
+{
+    if (mkdtemp(spool) == nullptr)
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    LogOptions logOptions;
+    logOptions.level = LogLevel::Error;
+    Log::start(logOptions);
+
+    ServerOptions options;
+    options.warmupThreads = 0;
+    options.quota.messages = MAX_MESSAGES;
+    options.maxMessageSize = FUZZ_MAX_INPUT;
+    server = new Server(0, spool, options);
+    atexit(cleanup);
+    return 0;
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+        {
+            return false; // The session ended before it read everything
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
+    {
+        perror("socketpair");
+        abort();
+    }
+
+    // The client sends the input and reads the answers at the same time, so neither side
+    // blocks on a full socket buffer
+    std::thread writer([&]() {
+        writeAll(sockets[1], data, std::min(size, static_cast<size_t>(FUZZ_MAX_INPUT)));
+        shutdown(sockets[1], SHUT_WR);
+    });
+    std::thread reader([&]() {
+        char buffer[65536];
+        while (read(sockets[1], buffer, sizeof(buffer)) > 0)
+        {
+        }
+    });
+
+    server->serveConnection(sockets[0]); // Closes sockets[0]
+    writer.join();
+    reader.join();
+    close(sockets[1]);
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Fuzz target for the line scanner: the vectorized implementation selected at runtime has to
+// find exactly the lines a plain byte-by-byte loop finds. make fuzz runs it once per
+// implementation with TWMAILER_SCANNER=scalar|sse2 and without it.
+#include "../twmailer-scanner.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// The rules of scanLines written out as plainly as possible
+static size_t referenceScan(const char *data, size_t length, std::vector<Span> &lines)
+{
+    size_t lineStart = 0;
+    size_t i = 0;
+    while (i < length)
+    {
+        if (data[i] == '\n')
+        {
+            lines.push_back(Span{lineStart, i - lineStart});
+            lineStart = i + 1;
+            i++;
+        }
+        else if (data[i] == '\\' && i + 1 < length && data[i + 1] == 'n')
+        {
+            lines.push_back(Span{lineStart, i - lineStart});
+            lineStart = i + 2;
+            i += 2;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return lineStart;
+}
+
+static void fail(const char *what, size_t size)
+{
+    fprintf(stderr, "fuzz-scanner: %s differs from the reference (%s, %zu bytes)\n", what,
+            scannerImplementation(), size);
+    abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const char *text = reinterpret_cast<const char *>(data);
+
+    std::vector<Span> lines, expected;
+    size_t covered = scanLines(text, size, lines);
+    if (covered != referenceScan(text, size, expected))
+    {
+        fail("scanLines return value", size);
+    }
+    if (lines.size() != expected.size())
+    {
+        fail("scanLines line count", size);
+    }
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        if (lines[i].offset != expected[i].offset || lines[i].length != expected[i].length)
+        {
+            fail("scanLines line", size);
+        }
+    }
+
+    size_t end = 0;
+    while (end < size && text[end] != '\n')
+    {
+        end++;
+    }
+    if (findLineEnd(text, size) != end)
+    {
+        fail("findLineEnd", size);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Fuzz target for the search tokenizer and index. The input is indexed as a stored message:
+// feeding it in pieces has to give the same terms as feeding it at once, every term has to
+// be findable with the matching field query, and nothing is found once it is removed.
+// The input is also run as a query.
+#include "../twmailer-search.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+static void fail(const char *what, const std::string &term)
+{
+    fprintf(stderr, "fuzz-search: %s: \"%s\"\n", what, term.c_str());
+    abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const char *text = reinterpret_cast<const char *>(data);
+
+    DocumentTerms whole;
+    whole.feed(text, size);
+    std::vector<std::string> terms = whole.finish();
+
+    // Split points taken from the input itself, so the fuzzer can steer them
+    size_t first = size > 0 ? data[0] % (size + 1) : 0;
+    size_t second = size > 1 ? first + data[1] % (size - first + 1) : first;
+    DocumentTerms pieces;
+    pieces.feed(text, first);
+    pieces.feed(text + first, second - first);
+    pieces.feed(text + second, size - second);
+    if (pieces.finish() != terms)
+    {
+        fail("terms depend on how the message is fed", std::string(text, size));
+    }
+
+    SearchIndex index;
+    index.addDocument(1, terms);
+    for (const std::string &term : terms)
+    {
+        if (term.length() < 3 || term[1] != ':' || (term[0] != 'f' && term[0] != 's' && term[0] != 'b'))
+        {
+            fail("malformed term", term);
+        }
+        for (size_t i = 2; i < term.length(); i++)
+        {
+            unsigned char c = term[i];
+            if (!(islower(c) || isdigit(c) || c >= 0x80))
+            {
+                fail("term with a separator or upper case letter", term);
+            }
+        }
+
+        std::string field = term[0] == 'f' ? "from:" : (term[0] == 's' ? "subject:" : "body:");
+        std::vector<uint32_t> ids = index.query(field + term.substr(2));
+        if (ids.size() != 1 || ids[0] != 1)
+        {
+            fail("indexed term not found", term);
+        }
+    }
+
+    std::vector<uint32_t> ids = index.query(std::string(text, size));
+    if (ids.size() > 1 || (ids.size() == 1 && ids[0] != 1))
+    {
+        fail("query found an unknown ID", std::string(text, size));
+    }
+
+    index.removeDocument(1);
+    for (const std::string &term : terms)
+    {
+        if (!index.query(term.substr(2)).empty())
+        {
+            fail("removed message still found", term);
+        }
+    }
+    return 0;
+}
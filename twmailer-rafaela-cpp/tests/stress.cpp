@@ -0,0 +1,515 @@
+// Stress harness: many client sessions race SEND, SYNC, READ, SEARCH, LIST and DEL on a few
+// shared mailboxes of an in-process server, each over its own socketpair and server thread.
+//
+//     stress [--clients <n>] [--mailboxes <n>] [--rounds <n>] [--min-rate <commands/s>]
+//
+// Every answer is checked against what the session itself sent: a stored message has to be
+// in SYNC exactly once with its size, READ has to return it byte for byte, SEARCH has to find
+// it, LIST has to be numbered without gaps, and a deleted message has to be gone. Afterwards
+// LIST, READ by number and SYNC of every mailbox have to show exactly the messages that were
+// kept, before and after the server is restarted on the same spool; a message sent after the
+// restart has to get a new ID. The harness fails on the first mismatch, and if fewer than
+// --min-rate commands per second were completed while the sessions raced.
+#include "../twmailer-server.h"
+#include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_MAILBOXES 3
+#define DEFAULT_ROUNDS 200
+#define KEEP_EVERY 3 // Every third message of a session is kept, the others are deleted again
+
+// One message a session stored and did not delete
+struct Kept {
+    std::string subject;
+    std::string content; // As READ returns it
+};
+
+static std::atomic<bool> failed(false);
+static std::mutex outputLock;
+
+static bool fail(const std::string &client, const std::string &what)
+{
+    std::lock_guard<std::mutex> guard(outputLock);
+    fprintf(stderr, "stress: %s: %s\n", client.c_str(), what.c_str());
+    failed = true;
+    return false;
+}
+
+// Client side of one session, served by the server on its own thread
+class Session {
+public:
+    Session(Server &server, const std::string &name) : name(name)
+    {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
+        {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        fd = sockets[1];
+        serverThread = std::thread(&Server::serveConnection, &server, sockets[0]);
+        std::string welcome;
+        readLine(welcome);
+    }
+
+    ~Session()
+    {
+        send("QUIT\n");
+        shutdown(fd, SHUT_WR);
+        serverThread.join();
+        close(fd);
+    }
+
+    void send(const std::string &command)
+    {
+        const char *data = command.data();
+        size_t left = command.size();
+        while (left > 0)
+        {
+            ssize_t written = write(fd, data, left);
+            if (written <= 0)
+            {
+                return; // Noticed by the next read
+            }
+            data += written;
+            left -= written;
+        }
+    }
+
+    bool readLine(std::string &line)
+    {
+        size_t end;
+        while ((end = buffer.find('\n')) == std::string::npos)
+        {
+            if (!fill())
+            {
+                return fail(name, "connection closed by the server");
+            }
+        }
+        line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        return true;
+    }
+
+    bool readBytes(size_t length, std::string &data)
+    {
+        while (buffer.size() < length)
+        {
+            if (!fill())
+            {
+                return fail(name, "connection closed by the server");
+            }
+        }
+        data = buffer.substr(0, length);
+        buffer.erase(0, length);
+        return true;
+    }
+
+    // Reads a header line with a count followed by that many lines
+    bool readList(std::string &header, std::vector<std::string> &lines, size_t countField)
+    {
+        if (!readLine(header))
+        {
+            return false;
+        }
+        std::istringstream fields(header);
+        std::string field;
+        for (size_t i = 0; i <= countField; i++)
+        {
+            fields >> field;
+        }
+        char *end;
+        unsigned long count = strtoul(field.c_str(), &end, 10);
+        if (field.empty() || *end != '\0')
+        {
+            return fail(name, "no count in \"" + header + "\"");
+        }
+        lines.resize(count);
+        for (std::string &line : lines)
+        {
+            if (!readLine(line))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string name;
+
+private:
+    bool fill()
+    {
+        char data[65536];
+        ssize_t bytes = read(fd, data, sizeof(data));
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        buffer.append(data, bytes);
+        return true;
+    }
+
+    int fd;
+    std::string buffer;
+    std::thread serverThread;
+};
+
+// Sends a message and returns the content READ is expected to return for it
+static std::string sendMessage(Session &session, const std::string &sender, const std::string &mailbox,
+                               const std::string &subject, const std::vector<std::string> &body)
+{
+    std::string command = "SEND\n" + sender + "\n" + mailbox + "\n" + subject + "\n";
+    std::string content = "Sender: " + sender + "\nReceiver: " + mailbox + "\nSubject: " + subject + "\nMessage: ";
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        command += body[i] + "\n";
+        content += body[i] + (i == 0 ? "\n\n" : "\n");
+    }
+    session.send(command + ".\n");
+    return content;
+}
+
+// Returns the ID of the message with the given subject from a FULL SYNC, 0 if it is missing
+// or listed more than once
+static uint32_t findInSync(Session &session, const std::string &mailbox, const std::string &subject, uint64_t size)
+{
+    session.send("SYNC\n" + mailbox + "\n\n");
+    std::string header;
+    std::vector<std::string> lines;
+    if (!session.readList(header, lines, 2))
+    {
+        return 0;
+    }
+    uint32_t id = 0;
+    for (const std::string &line : lines)
+    {
+        // +<id>\t<size>\t<subject>
+        size_t tab = line.find('\t');
+        size_t second = tab == std::string::npos ? tab : line.find('\t', tab + 1);
+        if (line[0] != '+' || second == std::string::npos)
+        {
+            fail(session.name, "malformed SYNC line \"" + line + "\"");
+            return 0;
+        }
+        if (line.compare(second + 1, std::string::npos, subject) == 0)
+        {
+            if (id != 0)
+            {
+                fail(session.name, "\"" + subject + "\" is in SYNC twice");
+                return 0;
+            }
+            id = strtoul(line.c_str() + 1, nullptr, 10);
+            if (strtoull(line.c_str() + tab + 1, nullptr, 10) != size)
+            {
+                fail(session.name, "SYNC reports a wrong size for \"" + subject + "\"");
+                return 0;
+            }
+        }
+    }
+    if (id == 0)
+    {
+        fail(session.name, "\"" + subject + "\" is missing from SYNC of " + mailbox);
+    }
+    return id;
+}
+
+static bool expectLine(Session &session, const std::string &expected, const std::string &command)
+{
+    std::string line;
+    if (!session.readLine(line))
+    {
+        return false;
+    }
+    return line == expected || fail(session.name, command + " answered \"" + line + "\" instead of \"" + expected + "\"");
+}
+
+static bool readMessage(Session &session, const std::string &mailbox, const std::string &reference, std::string &content)
+{
+    session.send("READ\n" + mailbox + "\n" + reference + "\n");
+    std::string line;
+    if (!session.readLine(line))
+    {
+        return false;
+    }
+    if (line.compare(0, 3, "OK ") != 0)
+    {
+        return fail(session.name, "READ " + mailbox + " " + reference + " answered \"" + line + "\"");
+    }
+    return session.readBytes(strtoull(line.c_str() + 3, nullptr, 10), content);
+}
+
+// Checks that LIST numbers the messages without gaps; returns their subjects in LIST order
+static bool listMessages(Session &session, const std::string &mailbox, std::vector<std::string> &subjects)
+{
+    session.send("LIST\n" + mailbox + "\n");
+    std::string header;
+    std::vector<std::string> lines;
+    if (!session.readList(header, lines, 0))
+    {
+        return false;
+    }
+    subjects.clear();
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        std::string prefix = std::to_string(i + 1) + ". ";
+        if (lines[i].compare(0, prefix.length(), prefix) != 0)
+        {
+            return fail(session.name, "LIST line " + std::to_string(i + 1) + " is \"" + lines[i] + "\"");
+        }
+        subjects.push_back(lines[i].substr(prefix.length()));
+    }
+    return true;
+}
+
+// One client: stores a message per round in one of the shared mailboxes, checks it through
+// every command and deletes all but every KEEP_EVERY-th one again
+static void runClient(Server &server, unsigned client, unsigned mailboxCount, unsigned rounds,
+                      std::map<std::string, std::vector<Kept>> &kept, std::map<std::string, uint32_t> &highestIds,
+                      std::atomic<uint64_t> &commands)
+{
+    std::string sender = "sender" + std::to_string(client);
+    Session session(server, "client " + std::to_string(client));
+    for (unsigned round = 0; round < rounds && !failed; round++)
+    {
+        std::string mailbox = "stress" + std::to_string((client + round) % mailboxCount);
+        std::string tag = "t" + std::to_string(client) + "x" + std::to_string(round);
+        std::string subject = "Stress " + tag;
+        std::vector<std::string> body;
+        for (unsigned line = 0; line <= round % 4; line++)
+        {
+            body.push_back("line " + std::to_string(line) + " of " + tag + " " + std::string((round * 37 + line) % 300, 'z'));
+        }
+
+        std::string content = sendMessage(session, sender, mailbox, subject, body);
+        if (!expectLine(session, "OK", "SEND"))
+        {
+            return;
+        }
+        uint32_t id = findInSync(session, mailbox, subject, content.size());
+        std::string reference = "#" + std::to_string(id);
+        std::string read;
+        if (id == 0 || !readMessage(session, mailbox, reference, read))
+        {
+            return;
+        }
+        if (read != content)
+        {
+            fail(session.name, "READ " + mailbox + " " + reference + " returned different content for \"" + subject + "\"");
+            return;
+        }
+
+        session.send("SEARCH\n" + mailbox + "\nsubject:" + tag + "\n");
+        std::string header;
+        std::vector<std::string> lines;
+        if (!session.readList(header, lines, 0))
+        {
+            return;
+        }
+        if (lines.size() != 1 || lines[0].find(". " + subject) == std::string::npos)
+        {
+            fail(session.name, "SEARCH for " + tag + " answered \"" + header + "\"");
+            return;
+        }
+
+        std::vector<std::string> subjects;
+        if (!listMessages(session, mailbox, subjects))
+        {
+            return;
+        }
+        if (std::count(subjects.begin(), subjects.end(), subject) != 1)
+        {
+            fail(session.name, "\"" + subject + "\" is not in LIST of " + mailbox + " exactly once");
+            return;
+        }
+        commands += 5;
+
+        std::unique_lock<std::mutex> guard(outputLock);
+        highestIds[mailbox] = std::max(highestIds[mailbox], id);
+        if (round % KEEP_EVERY == 0)
+        {
+            kept[mailbox].push_back(Kept{subject, content});
+            continue;
+        }
+        guard.unlock();
+        session.send("DEL\n" + mailbox + "\n" + reference + "\n");
+        if (!expectLine(session, "OK", "DEL " + mailbox + " " + reference))
+        {
+            return;
+        }
+        session.send("READ\n" + mailbox + "\n" + reference + "\n");
+        if (!expectLine(session, "ERR", "READ of the deleted " + mailbox + " " + reference))
+        {
+            return;
+        }
+        commands += 2;
+    }
+}
+
+// Compares every mailbox with the messages the clients kept: LIST and SYNC have to show
+// exactly those, and READ of each LIST number has to return the message listed there
+static bool checkMailboxes(Server &server, const std::map<std::string, std::vector<Kept>> &kept)
+{
+    Session session(server, "final check");
+    for (const auto &mailbox : kept)
+    {
+        std::map<std::string, const Kept *> expected;
+        for (const Kept &message : mailbox.second)
+        {
+            expected[message.subject] = &message;
+        }
+
+        std::vector<std::string> subjects;
+        if (!listMessages(session, mailbox.first, subjects))
+        {
+            return false;
+        }
+        if (subjects.size() != expected.size())
+        {
+            return fail(session.name, "LIST of " + mailbox.first + " has " + std::to_string(subjects.size()) +
+                                          " messages instead of " + std::to_string(expected.size()));
+        }
+        for (size_t i = 0; i < subjects.size(); i++)
+        {
+            auto it = expected.find(subjects[i]);
+            std::string content;
+            if (it == expected.end())
+            {
+                return fail(session.name, "LIST of " + mailbox.first + " shows the deleted \"" + subjects[i] + "\"");
+            }
+            if (!readMessage(session, mailbox.first, std::to_string(i + 1), content))
+            {
+                return false;
+            }
+            if (content != it->second->content)
+            {
+                return fail(session.name, "READ " + mailbox.first + " " + std::to_string(i + 1) +
+                                              " does not return \"" + subjects[i] + "\" listed there");
+            }
+        }
+
+        for (const Kept &message : mailbox.second)
+        {
+            if (findInSync(session, mailbox.first, message.subject, message.content.size()) == 0)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+    return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned clients = DEFAULT_CLIENTS;
+    unsigned mailboxCount = DEFAULT_MAILBOXES;
+    unsigned rounds = DEFAULT_ROUNDS;
+    double minRate = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--clients")
+        {
+            clients = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (i + 1 < argc && arg == "--mailboxes")
+        {
+            mailboxCount = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (i + 1 < argc && arg == "--rounds")
+        {
+            rounds = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (i + 1 < argc && arg == "--min-rate")
+        {
+            minRate = strtod(argv[++i], nullptr);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--clients <n>] [--mailboxes <n>] [--rounds <n>] [--min-rate <commands/s>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (clients == 0 || mailboxCount == 0)
+    {
+        fprintf(stderr, "stress: --clients and --mailboxes need at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    char spool[] = "/tmp/twmailer-stress-XXXXXX";
+    if (mkdtemp(spool) == nullptr)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    LogOptions logOptions;
+    logOptions.level = LogLevel::Warning;
+    Log::start(logOptions);
+
+    ServerOptions options;
+    options.warmupThreads = 0;
+    std::unique_ptr<Server> server(new Server(0, spool, options));
+
+    std::map<std::string, std::vector<Kept>> kept;
+    std::map<std::string, uint32_t> highestIds; // Highest ID handed out per mailbox, deleted messages included
+    std::atomic<uint64_t> commands(0);
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned client = 0; client < clients; client++)
+    {
+        threads.push_back(std::thread(runClient, std::ref(*server), client, mailboxCount, rounds, std::ref(kept),
+                                      std::ref(highestIds), std::ref(commands)));
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double rate = commands / seconds;
+
+    // The index has to survive a restart, and IDs of deleted messages are not reused
+    if (!failed && checkMailboxes(*server, kept))
+    {
+        server.reset(); // Only one server may use the spool
+        server.reset(new Server(0, spool, options));
+        if (checkMailboxes(*server, kept))
+        {
+            Session session(*server, "after restart");
+            for (const auto &mailbox : highestIds)
+            {
+                std::string content = sendMessage(session, "restart", mailbox.first, "Stress restart", {"after the restart"});
+                uint32_t id = expectLine(session, "OK", "SEND") ? findInSync(session, mailbox.first, "Stress restart", content.size()) : 0;
+                if (id != 0 && id <= mailbox.second)
+                {
+                    fail(session.name, "the message sent to " + mailbox.first + " after the restart got the used ID " +
+                                           std::to_string(id));
+                }
+            }
+        }
+    }
+    server.reset();
+    nftw(spool, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("stress: %llu commands from %u clients on %u mailboxes in %.2f s, %.0f commands/s\n",
+           static_cast<unsigned long long>(commands.load()), clients, mailboxCount, seconds, rate);
+    if (failed)
+    {
+        return EXIT_FAILURE;
+    }
+    if (rate < minRate)
+    {
+        fprintf(stderr, "stress: %.0f commands/s is below --min-rate %.0f\n", rate, minRate);
+        return EXIT_FAILURE;
+    }
+    printf("stress: all checks passed\n");
+    return EXIT_SUCCESS;
+}
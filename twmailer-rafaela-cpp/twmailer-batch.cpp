@@ -0,0 +1,502 @@
+#include "twmailer-batch.h"
+#include "twmailer-client.h"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+
+#define PIPELINE_BATCH 65536 // Bytes of commands collected before they are sent
+
+// One command of the script and its result
+struct BatchCommand {
+    size_t line;          // Line number in the script
+    std::string name;     // SEND, LIST, READ, DEL, SEARCH, SYNC or QUOTA
+    std::string mailbox;  // Mailbox the command works on; decides the connection
+    std::string wire;     // Command as sent to the server, empty if the command is invalid
+    std::string status;   // OK or ERR
+    std::string response; // Server response or the reason the command was rejected
+};
+
+// Appends a code point as UTF-8
+static void appendUtf8(std::string &out, unsigned long codePoint)
+{
+    if (codePoint < 0x80)
+    {
+        out += static_cast<char>(codePoint);
+    }
+    else if (codePoint < 0x800)
+    {
+        out += static_cast<char>(0xc0 | (codePoint >> 6));
+        out += static_cast<char>(0x80 | (codePoint & 0x3f));
+    }
+    else if (codePoint < 0x10000)
+    {
+        out += static_cast<char>(0xe0 | (codePoint >> 12));
+        out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (codePoint & 0x3f));
+    }
+    else
+    {
+        out += static_cast<char>(0xf0 | (codePoint >> 18));
+        out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (codePoint & 0x3f));
+    }
+}
+
+// Parses a JSON string starting at the opening quote; position ends after the closing quote
+static bool parseJsonString(const std::string &text, size_t &position, std::string &value)
+{
+    value.clear();
+    position++; // Opening quote
+    while (position < text.length())
+    {
+        char c = text[position++];
+        if (c == '"')
+        {
+            return true;
+        }
+        if (c != '\\')
+        {
+            value += c;
+            continue;
+        }
+        if (position >= text.length())
+        {
+            return false;
+        }
+        char escape = text[position++];
+        switch (escape)
+        {
+        case 'n':
+            value += '\n';
+            break;
+        case 't':
+            value += '\t';
+            break;
+        case 'r':
+            value += '\r';
+            break;
+        case 'b':
+            value += '\b';
+            break;
+        case 'f':
+            value += '\f';
+            break;
+        case 'u':
+        {
+            if (position + 4 > text.length())
+            {
+                return false;
+            }
+            unsigned long codePoint = strtoul(text.substr(position, 4).c_str(), nullptr, 16);
+            position += 4;
+            // Surrogate pair
+            if (codePoint >= 0xd800 && codePoint < 0xdc00 && text.compare(position, 2, "\\u") == 0 &&
+                position + 6 <= text.length())
+            {
+                unsigned long low = strtoul(text.substr(position + 2, 4).c_str(), nullptr, 16);
+                codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+                position += 6;
+            }
+            appendUtf8(value, codePoint);
+            break;
+        }
+        default:
+            value += escape; // \" \\ \/
+        }
+    }
+    return false;
+}
+
+// Parses a flat JSON object; numbers and literals are kept as their text
+static bool parseJsonObject(const std::string &text, std::map<std::string, std::string> &fields)
+{
+    size_t position = text.find_first_not_of(" \t\r");
+    if (position == std::string::npos || text[position] != '{')
+    {
+        return false;
+    }
+    position++;
+
+    while (true)
+    {
+        position = text.find_first_not_of(" \t\r", position);
+        if (position == std::string::npos)
+        {
+            return false;
+        }
+        if (text[position] == '}')
+        {
+            return true;
+        }
+
+        std::string key, value;
+        if (text[position] != '"' || !parseJsonString(text, position, key))
+        {
+            return false;
+        }
+        position = text.find_first_not_of(" \t\r", position);
+        if (position == std::string::npos || text[position] != ':')
+        {
+            return false;
+        }
+        position = text.find_first_not_of(" \t\r", position + 1);
+        if (position == std::string::npos)
+        {
+            return false;
+        }
+        if (text[position] == '"')
+        {
+            if (!parseJsonString(text, position, value))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            size_t end = text.find_first_of(",} \t\r", position);
+            if (end == std::string::npos)
+            {
+                return false;
+            }
+            value = text.substr(position, end - position);
+            position = end;
+        }
+        fields[key] = value;
+
+        position = text.find_first_not_of(" \t\r", position);
+        if (position != std::string::npos && text[position] == ',')
+        {
+            position++;
+        }
+    }
+}
+
+static std::string jsonEscape(const std::string &text)
+{
+    std::string out;
+    for (unsigned char c : text)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+            {
+                out += static_cast<char>(c);
+            }
+        }
+    }
+    return out;
+}
+
+// Turns a tab separated script line into the same fields a JSON line has
+static void parseScriptLine(const std::string &text, std::map<std::string, std::string> &fields)
+{
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (true)
+    {
+        size_t tab = text.find('\t', start);
+        parts.push_back(text.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if (tab == std::string::npos)
+        {
+            break;
+        }
+        start = tab + 1;
+    }
+
+    static const std::map<std::string, std::vector<std::string>> names = {
+        {"SEND", {"sender", "receiver", "subject", "message", "ttl"}},
+        {"LIST", {"user"}},
+        {"READ", {"user", "number"}},
+        {"DEL", {"user", "number"}},
+        {"SEARCH", {"user", "query"}},
+        {"SYNC", {"user", "token"}},
+        {"QUOTA", {"user"}},
+    };
+    fields["command"] = parts[0];
+    auto it = names.find(parts[0]);
+    for (size_t i = 1; it != names.end() && i < parts.size() && i <= it->second.size(); i++)
+    {
+        fields[it->second[i - 1]] = parts[i];
+    }
+
+    // The message may contain "\n" escapes for line breaks
+    std::string &message = fields["message"];
+    for (size_t index = 0; (index = message.find("\\n", index)) != std::string::npos; index++)
+    {
+        message.replace(index, 2, "\n");
+    }
+}
+
+static bool checkUser(const std::string &name, std::string &error)
+{
+    if (name.empty())
+    {
+        error = "missing user name";
+        return false;
+    }
+    return Client::checkName(name, error);
+}
+
+// Validates the fields and builds the command in wire format
+static bool buildCommand(std::map<std::string, std::string> &fields, BatchCommand &command, std::string &error)
+{
+    command.name = fields["command"];
+    for (char &c : command.name)
+    {
+        c = toupper(c);
+    }
+
+    if (command.name == "SEND")
+    {
+        std::string message = fields["message"];
+        if (!checkUser(fields["sender"], error) || !checkUser(fields["receiver"], error))
+        {
+            return false;
+        }
+        if (fields["subject"].find('\n') != std::string::npos)
+        {
+            error = "subject must be a single line";
+            return false;
+        }
+        if (!message.empty() && message[message.length() - 1] != '\n')
+        {
+            message += '\n';
+        }
+        if (message == ".\n" || message.compare(0, 2, ".\n") == 0 || message.find("\n.\n") != std::string::npos)
+        {
+            error = "message contains a line with a single '.'";
+            return false;
+        }
+        const std::string &ttl = fields["ttl"];
+        if (!ttl.empty() && ttl.find_first_not_of("0123456789") != std::string::npos)
+        {
+            error = "invalid TTL";
+            return false;
+        }
+        command.mailbox = fields["receiver"];
+        command.wire = "SEND" + (ttl.empty() ? "" : " " + ttl) + "\n" + fields["sender"] + "\n" + fields["receiver"] + "\n" + fields["subject"] + "\n" + message + ".\n";
+        return true;
+    }
+
+    command.mailbox = fields["user"];
+    if (!checkUser(command.mailbox, error))
+    {
+        return false;
+    }
+    if (command.name == "LIST")
+    {
+        command.wire = "LIST\n" + command.mailbox + "\n";
+    }
+    else if (command.name == "READ" || command.name == "DEL")
+    {
+        const std::string &number = fields["number"];
+        size_t digits = !number.empty() && number[0] == '#' ? 1 : 0; // "#<id>" addresses a message by ID
+        if (number.length() == digits || number.find_first_not_of("0123456789", digits) != std::string::npos)
+        {
+            error = "invalid message number";
+            return false;
+        }
+        command.wire = command.name + "\n" + command.mailbox + "\n" + number + "\n";
+    }
+    else if (command.name == "SEARCH")
+    {
+        command.wire = "SEARCH\n" + command.mailbox + "\n" + fields["query"] + "\n";
+    }
+    else if (command.name == "SYNC")
+    {
+        command.wire = "SYNC\n" + command.mailbox + "\n" + fields["token"] + "\n";
+    }
+    else if (command.name == "QUOTA")
+    {
+        command.wire = "QUOTA\n" + command.mailbox + "\n";
+    }
+    else
+    {
+        error = "unknown command";
+        return false;
+    }
+    return true;
+}
+
+// Sends all commands of one connection from a writer thread while this thread reads the responses
+static bool runConnection(Client &client, std::vector<BatchCommand *> &commands)
+{
+    bool sent = true;
+    std::thread writer([&]() {
+        std::string batch;
+        for (BatchCommand *command : commands)
+        {
+            batch += command->wire;
+            if (batch.length() >= PIPELINE_BATCH)
+            {
+                if (!client.sendCommand(batch))
+                {
+                    sent = false;
+                    return;
+                }
+                batch.clear();
+            }
+        }
+        batch += "QUIT\n";
+        sent = client.sendCommand(batch);
+    });
+
+    bool received = true;
+    for (BatchCommand *command : commands)
+    {
+        if (received && client.receiveResponse(command->name, command->response))
+        {
+            command->status = command->response.compare(0, 3, "ERR") == 0 ? "ERR" : "OK";
+        }
+        else
+        {
+            received = false;
+            command->status = "ERR";
+            command->response = "connection lost";
+        }
+    }
+
+    writer.join();
+    return sent && received;
+}
+
+bool runBatch(const std::string &ip, int port, const std::string &scriptPath, unsigned connections, TlsContext *tls)
+{
+    std::ifstream script(scriptPath);
+    if (!script.is_open())
+    {
+        std::cerr << "Unable to open script: " << scriptPath << "\n";
+        return false;
+    }
+
+    std::vector<BatchCommand> commands;
+    std::string text;
+    for (size_t line = 1; std::getline(script, text); line++)
+    {
+        if (text.empty() || text[0] == '#' || text.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            continue;
+        }
+
+        std::map<std::string, std::string> fields;
+        BatchCommand command;
+        command.line = line;
+        std::string error;
+        if (text[text.find_first_not_of(" \t")] == '{')
+        {
+            if (!parseJsonObject(text, fields))
+            {
+                fields.clear();
+                error = "invalid JSON";
+            }
+        }
+        else
+        {
+            parseScriptLine(text, fields);
+        }
+        if (error.empty() && !buildCommand(fields, command, error))
+        {
+            command.wire.clear();
+        }
+        if (!error.empty())
+        {
+            command.status = "ERR";
+            command.response = error;
+        }
+        commands.push_back(command);
+    }
+
+    // Commands for one mailbox go to the same connection so their order is kept
+    connections = std::max(connections, 1u);
+    std::vector<std::vector<BatchCommand *>> groups(connections);
+    for (BatchCommand &command : commands)
+    {
+        if (!command.wire.empty())
+        {
+            groups[std::hash<std::string>()(command.mailbox) % connections].push_back(&command);
+        }
+    }
+
+    // Connections are opened one after another, so with TLS all but the first one resume
+    // the session of the one before
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<Client>> clients(connections);
+    for (unsigned i = 0; i < connections; i++)
+    {
+        if (!groups[i].empty())
+        {
+            clients[i].reset(new Client(ip, port, tls));
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<char> succeeded(connections, 1);
+    for (unsigned i = 0; i < connections; i++)
+    {
+        if (clients[i])
+        {
+            threads.push_back(std::thread([&, i]() { succeeded[i] = runConnection(*clients[i], groups[i]); }));
+        }
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    size_t errors = 0;
+    for (const BatchCommand &command : commands)
+    {
+        errors += command.status == "ERR";
+        std::cout << "{\"line\":" << command.line << ",\"command\":\"" << jsonEscape(command.name) << "\",\"status\":\""
+                  << command.status << "\",\"response\":\"" << jsonEscape(command.response) << "\"}\n";
+    }
+    std::cout.flush();
+
+    std::cerr << commands.size() << " commands (" << errors << " ERR) over " << threads.size() << " connections in "
+              << seconds << " s, " << (seconds > 0 ? commands.size() / seconds : 0) << " commands/s\n";
+    if (tls)
+    {
+        std::cerr << "TLS: " << tls->statistics() << "\n";
+    }
+
+    for (char ok : succeeded)
+    {
+        if (!ok)
+        {
+            return false;
+        }
+    }
+    return true;
+}
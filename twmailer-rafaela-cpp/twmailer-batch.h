@@ -0,0 +1,19 @@
+#ifndef BATCH_H
+#define BATCH_H
+#pragma once
+
+#include <string>
+#include "twmailer-tls.h"
+
+// Runs the commands of a script non-interactively. Each line of the script is either
+// a JSON object ({"command":"SEND","sender":...}) or tab separated fields
+// (SEND<TAB>sender<TAB>receiver<TAB>subject<TAB>message). The commands are pipelined
+// over `connections` parallel connections; commands for the same mailbox always use
+// the same connection so they keep their order. One JSON result per command is
+// printed to stdout in script order, a summary to stderr.
+// With a TLS context every connection is encrypted and the handshakes are summarized too.
+// Returns false if the script could not be read or a connection failed.
+bool runBatch(const std::string& ip, int port, const std::string& scriptPath, unsigned connections,
+              TlsContext* tls = nullptr);
+
+#endif // BATCH_H
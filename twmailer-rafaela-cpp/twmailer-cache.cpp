@@ -0,0 +1,208 @@
+#include "twmailer-cache.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/stat.h>
+
+#define SYNC_STATE ".sync"
+
+MailCache::MailCache(const std::string &directory)
+{
+    MailCache::directory = directory;
+    if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        perror("Error creating cache directory");
+    }
+}
+
+std::string MailCache::userDirectory(const std::string &user)
+{
+    std::string path = directory + "/" + user;
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        perror("Error creating cache directory");
+    }
+    return path;
+}
+
+std::string MailCache::messagePath(const std::string &user, uint32_t id)
+{
+    return directory + "/" + user + "/" + std::to_string(id) + ".txt";
+}
+
+// Parses "<id>\t<size>\t<subject>"
+static bool parseMessage(const std::string &line, CachedMessage &message)
+{
+    size_t first = line.find('\t');
+    size_t second = first == std::string::npos ? std::string::npos : line.find('\t', first + 1);
+    if (second == std::string::npos)
+    {
+        return false;
+    }
+    message.id = strtoul(line.c_str(), nullptr, 10);
+    message.size = strtoull(line.c_str() + first + 1, nullptr, 10);
+    message.subject = line.substr(second + 1);
+    return message.id != 0;
+}
+
+void MailCache::load(const std::string &user, std::string &token, std::vector<CachedMessage> &messages)
+{
+    token.clear();
+    messages.clear();
+
+    std::ifstream state(directory + "/" + user + "/" + SYNC_STATE);
+    if (!std::getline(state, token))
+    {
+        token.clear();
+        return;
+    }
+    std::string line;
+    CachedMessage message;
+    while (std::getline(state, line))
+    {
+        if (parseMessage(line, message))
+        {
+            messages.push_back(message);
+        }
+    }
+}
+
+// The state is written to a temporary file first so an interrupted save keeps the old one
+bool MailCache::save(const std::string &user, const std::string &token, const std::vector<CachedMessage> &messages)
+{
+    std::string path = userDirectory(user) + "/" + SYNC_STATE;
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream state(tempPath, std::ios::trunc);
+        state << token << "\n";
+        for (const CachedMessage &message : messages)
+        {
+            state << message.id << "\t" << message.size << "\t" << message.subject << "\n";
+        }
+        if (!state.good())
+        {
+            std::cerr << "Error writing cache state: " << tempPath << "\n";
+            return false;
+        }
+    }
+    if (rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        perror("Error saving cache state");
+        return false;
+    }
+    return true;
+}
+
+bool MailCache::applySync(const std::string &user, const std::string &response, size_t &added, size_t &removed)
+{
+    std::istringstream lines(response);
+    std::string header;
+    std::getline(lines, header);
+
+    // Header: FULL|DELTA <token> <count>
+    std::istringstream fields(header);
+    std::string kind, token;
+    fields >> kind >> token;
+    if ((kind != "FULL" && kind != "DELTA") || token.empty())
+    {
+        return false;
+    }
+
+    std::string oldToken;
+    std::vector<CachedMessage> messages;
+    load(user, oldToken, messages);
+    added = 0;
+    removed = 0;
+
+    std::vector<CachedMessage> updated;
+    if (kind == "DELTA")
+    {
+        updated = messages;
+    }
+
+    auto byId = [](const CachedMessage &message, uint32_t id) { return message.id < id; };
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (line.empty())
+        {
+            continue;
+        }
+        if (line[0] == '+')
+        {
+            CachedMessage message;
+            if (!parseMessage(line.substr(1), message))
+            {
+                continue;
+            }
+            auto it = std::lower_bound(updated.begin(), updated.end(), message.id, byId);
+            if (it != updated.end() && it->id == message.id)
+            {
+                *it = message;
+            }
+            else
+            {
+                updated.insert(it, message);
+            }
+        }
+        else if (line[0] == '-')
+        {
+            uint32_t id = strtoul(line.c_str() + 1, nullptr, 10);
+            auto it = std::lower_bound(updated.begin(), updated.end(), id, byId);
+            if (it != updated.end() && it->id == id)
+            {
+                updated.erase(it);
+            }
+        }
+    }
+
+    // Compare with the previous list to drop the bodies of removed messages
+    for (const CachedMessage &message : messages)
+    {
+        if (!std::binary_search(updated.begin(), updated.end(), message,
+                                [](const CachedMessage &a, const CachedMessage &b) { return a.id < b.id; }))
+        {
+            removeMessage(user, message.id);
+            removed++;
+        }
+    }
+    added = updated.size() + removed - messages.size();
+
+    return save(user, token, updated);
+}
+
+bool MailCache::readMessage(const std::string &user, uint32_t id, std::string &content)
+{
+    std::ifstream file(messagePath(user, id), std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    content.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+void MailCache::storeMessage(const std::string &user, uint32_t id, const std::string &content)
+{
+    userDirectory(user);
+    std::string path = messagePath(user, id);
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file << content;
+        if (!file.good())
+        {
+            return;
+        }
+    }
+    rename(tempPath.c_str(), path.c_str());
+}
+
+void MailCache::removeMessage(const std::string &user, uint32_t id)
+{
+    remove(messagePath(user, id).c_str());
+}
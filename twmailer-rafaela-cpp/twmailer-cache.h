@@ -0,0 +1,42 @@
+#ifndef CACHE_H
+#define CACHE_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// One message of a mailbox as known to the client
+struct CachedMessage {
+    uint32_t id; // Server message ID, usable as "#<id>" with READ and DEL
+    uint64_t size;
+    std::string subject;
+};
+
+// Local copy of mailboxes kept by the client in <directory>/<user>/.
+// The file .sync holds the last sync token and the message list; <id>.txt holds
+// the messages read so far. Message IDs are never reused by the server, so a
+// cached message stays valid until SYNC reports it as removed.
+class MailCache {
+public:
+    explicit MailCache(const std::string& directory);
+
+    // Loads the cached state of a user; the token is empty if the user was never synced
+    void load(const std::string& user, std::string& token, std::vector<CachedMessage>& messages);
+
+    // Applies a SYNC response ("FULL|DELTA <token> <count>" and the change lines) and saves it
+    bool applySync(const std::string& user, const std::string& response, size_t& added, size_t& removed);
+
+    bool readMessage(const std::string& user, uint32_t id, std::string& content);
+    void storeMessage(const std::string& user, uint32_t id, const std::string& content);
+    void removeMessage(const std::string& user, uint32_t id);
+
+private:
+    std::string userDirectory(const std::string& user);
+    std::string messagePath(const std::string& user, uint32_t id);
+    bool save(const std::string& user, const std::string& token, const std::vector<CachedMessage>& messages);
+
+    std::string directory;
+};
+
+#endif // CACHE_H
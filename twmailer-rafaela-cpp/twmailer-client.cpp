@@ -1,4 +1,6 @@
 #include "twmailer-client.h"
+#include "twmailer-batch.h"
+#include "twmailer-scanner.h"
 #include <iostream>
 #include <cstring>
 #include <string>
@@ -6,17 +8,27 @@
 #include <arpa/inet.h>
 #include <vector>
 #include <cctype>
+#include <cerrno>
+#include <algorithm>
 
 #define BUF 1024
 
-// Sets the IP and port for the server, creates a socket, connects to the server, and handles communication
-Client::Client(std::string ip, int port)
+// Sets the IP and port for the server, creates a socket, connects to the server and receives its welcome message.
+// With a TLS context the connection is encrypted and the server's certificate must match the IP.
+Client::Client(std::string ip, int port, TlsContext *tls)
 {
     Client::ip = ip;
     Client::port = port;
+    receivedOffset = 0;
     clientSocket = createClientSocket();
     connectToServer();
-    handleCommunication();
+    transport.attach(clientSocket);
+    if (tls && !tls->connect(transport, ip))
+    {
+        closeConnection();
+        exit(EXIT_FAILURE);
+    }
+    receiveWelcomeMessageFromServer();
 }
 
 // Closes the connection when the client object is destroyed
@@ -67,7 +79,8 @@ void Client::connectToServer()
 // Handles communication wiht the server
 void Client::handleCommunication()
 {
-    receiveWelcomeMessageFromServer();
+    // print server's welcome message
+    std::cout << "\n<< " << welcomeMessage << "\n";
 
     char buffer[BUF];
 
@@ -87,6 +100,22 @@ void Client::handleCommunication()
             continue;
         }
 
+        // With a cache LIST, READ and DEL work on the local copy of the mailbox
+        if (cache && (command == "LIST" || command == "READ" || command == "DEL" || command == "SYNC"))
+        {
+            if (!handleCachedCommand(command))
+            {
+                std::cerr << "Server closed remote socket or recv error" << std::endl;
+                return;
+            }
+            continue;
+        }
+        if (command == "SYNC")
+        {
+            std::cout << "SYNC needs a local cache, start the client with --cache <dir>\n";
+            continue;
+        }
+
         // SEND Command
         if (command == "SEND")
         {
@@ -129,9 +158,9 @@ void Client::handleCommunication()
                 }
             } while (line != ".");
 
-            // Send the command, sender, and receiver to the server
-            std::string fullCommand = command + "\n" + sender + "\n" + receiver + "\n" + subject + "\n" + message + "\n";
-            if (send(clientSocket, fullCommand.c_str(), fullCommand.length(), 0) == -1)
+            // Send the command, sender, receiver, subject and message; a "." line ends the message
+            std::string fullCommand = command + "\n" + sender + "\n" + receiver + "\n" + subject + "\n" + message + ".\n";
+            if (!sendCommand(fullCommand))
             {
                 std::cout << "Error!";
                 break;
@@ -157,7 +186,7 @@ void Client::handleCommunication()
             }
 
             std::string fullCommand = command + "\n" + inboxuser + "\n";
-            if (send(clientSocket, fullCommand.c_str(), fullCommand.length(), 0) == -1)
+            if (!sendCommand(fullCommand))
             {
                 perror("Send error");
                 break;
@@ -183,7 +212,7 @@ void Client::handleCommunication()
             std::getline(std::cin, messageNumber);
 
             std::string fullCommand = command + "\n" + username + "\n" + messageNumber + "\n";
-            if (send(clientSocket, fullCommand.c_str(), fullCommand.length(), 0) == -1)
+            if (!sendCommand(fullCommand))
             {
                 perror("Send error");
                 break;
@@ -210,51 +239,320 @@ void Client::handleCommunication()
 
             // Send the command, username, and messageNumber to the server
             std::string fullCommand = command + "\n" + username + "\n" + messageNumber + "\n";
-            if (send(clientSocket, fullCommand.c_str(), fullCommand.length(), 0) == -1)
+            if (!sendCommand(fullCommand))
             {
                 perror("Send error");
                 break;
             }
         }
 
-        // QUIT Command
-        if (command == "QUIT")
+        // SEARCH Command
+        if (command == "SEARCH")
         {
-            // Send the command, username, and messageNumber to the server
-            std::string fullCommand = command;
-            if (send(clientSocket, fullCommand.c_str(), fullCommand.length(), 0) == -1)
+            std::cout << "Enter the Username: ";
+            std::string username;
+            std::getline(std::cin, username);
+
+            while (!isValidName(username))
+            {
+                std::cout << "Please enter a valid Username\n";
+                std::cout << "Enter the Username: ";
+                std::getline(std::cin, username);
+            }
+
+            std::cout << "Enter the Search Terms (words, optionally from:, subject: or body:): ";
+            std::string query;
+            std::getline(std::cin, query);
+
+            std::string fullCommand = command + "\n" + username + "\n" + query + "\n";
+            if (!sendCommand(fullCommand))
             {
                 perror("Send error");
                 break;
             }
         }
 
+        // QUOTA Command
+        if (command == "QUOTA")
+        {
+            std::string username = promptUsername();
+            if (!sendCommand(command + "\n" + username + "\n"))
+            {
+                perror("Send error");
+                break;
+            }
+        }
+
+        // QUIT Command
+        if (command == "QUIT")
+        {
+            // Send the command to the server; it closes the connection without a response
+            sendCommand(command + "\n");
+            return;
+        }
+
         std::string serverResponse;
-        while (true)
+        if (!receiveResponse(command, serverResponse))
+        {
+            std::cerr << "Server closed remote socket or recv error" << std::endl;
+            return;
+        }
+
+        std::cout << "<< " << serverResponse;
+    }
+}
+
+void Client::setCache(const std::string &directory)
+{
+    cache.reset(new MailCache(directory));
+}
+
+// Asks for a user name until a valid one is entered
+std::string Client::promptUsername()
+{
+    std::cout << "Enter the Username: ";
+    std::string username;
+    std::getline(std::cin, username);
+
+    while (!isValidName(username))
+    {
+        std::cout << "Please enter a valid Username\n";
+        std::cout << "Enter the Username: ";
+        std::getline(std::cin, username);
+    }
+    return username;
+}
+
+// Brings the cached message list of a user up to date. Without force a mailbox that
+// was synced before is used as it is, so repeated commands cost no network traffic.
+bool Client::syncMailbox(const std::string &username, std::vector<CachedMessage> &messages, bool force)
+{
+    std::string token;
+    cache->load(username, token, messages);
+    if (!token.empty() && !force)
+    {
+        return true;
+    }
+
+    std::string response;
+    if (!sendCommand("SYNC\n" + username + "\n" + token + "\n") || !receiveResponse("SYNC", response))
+    {
+        return false;
+    }
+    size_t added, removed;
+    if (response.compare(0, 3, "ERR") == 0 || !cache->applySync(username, response, added, removed))
+    {
+        std::cout << "<< " << response.substr(0, response.find('\n') + 1);
+        messages.clear();
+        return true;
+    }
+    cache->load(username, token, messages);
+    std::cout << "<< Synced " << username << ": " << added << " new, " << removed << " removed, "
+              << messages.size() << " in total\n";
+    return true;
+}
+
+// LIST, READ, DEL and SYNC against the local cache. LIST and SYNC fetch the changes since
+// the last sync; READ downloads a message only once and DEL addresses it by its ID.
+// Returns false if the connection was lost.
+bool Client::handleCachedCommand(const std::string &command)
+{
+    std::string username = promptUsername();
+    std::vector<CachedMessage> messages;
+    if (!syncMailbox(username, messages, command == "LIST" || command == "SYNC"))
+    {
+        return false;
+    }
+
+    if (command == "LIST")
+    {
+        std::cout << "<< " << messages.size() << " Mails found in Inbox of " << username << "\n";
+        for (size_t i = 0; i < messages.size(); i++)
         {
-            ssize_t size = recv(clientSocket, buffer, BUF - 1, 0);
-            if (size <= 0)
+            std::cout << i + 1 << ". " << messages[i].subject << "\n";
+        }
+        return true;
+    }
+    if (command == "SYNC")
+    {
+        return true;
+    }
+
+    std::cout << "Enter the Message Number: ";
+    std::string messageNumber;
+    std::getline(std::cin, messageNumber);
+    unsigned long number = strtoul(messageNumber.c_str(), nullptr, 10);
+    if (number < 1 || number > messages.size())
+    {
+        std::cout << "<< ERR\n";
+        return true;
+    }
+    uint32_t id = messages[number - 1].id;
+
+    std::string response;
+    if (command == "READ")
+    {
+        std::string content;
+        if (!cache->readMessage(username, id, content))
+        {
+            if (!sendCommand("READ\n" + username + "\n#" + std::to_string(id) + "\n") || !receiveResponse("READ", response))
             {
-                std::cerr << "Server closed remote socket or recv error" << std::endl;
-                return;
+                return false;
             }
-            buffer[size] = '\0';
-            serverResponse += buffer;
-            if (serverResponse.find("\n") != std::string::npos)
+            if (response.compare(0, 3, "ERR") == 0)
             {
-                break;
+                std::cout << "<< " << response;
+                return true;
             }
+            content = response.substr(response.find('\n') + 1);
+            cache->storeMessage(username, id, content);
         }
+        std::cout << "<< OK " << content.length() << "\n" << content;
+        return true;
+    }
 
-        std::cout << "<< " << serverResponse;
+    // DEL: the ID stays correct even if the mailbox changed since the last sync
+    if (!sendCommand("DEL\n" + username + "\n#" + std::to_string(id) + "\n") || !receiveResponse("DEL", response))
+    {
+        return false;
     }
+    if (response.compare(0, 2, "OK") == 0)
+    {
+        cache->removeMessage(username, id);
+        syncMailbox(username, messages, true);
+    }
+    std::cout << "<< " << response;
+    return true;
+}
+
+// Sends a complete command, retrying partial writes
+bool Client::sendCommand(const std::string &command)
+{
+    if (!transport.sendAll(command))
+    {
+        perror("Send error");
+        return false;
+    }
+    return true;
+}
+
+// Receives more data from the server into the receive buffer
+bool Client::receiveMore()
+{
+    // Drop what was already consumed before the buffer grows
+    if (receivedOffset > 0 && receivedOffset * 2 >= received.size())
+    {
+        received.erase(0, receivedOffset);
+        receivedOffset = 0;
+    }
+
+    char buffer[BUF * 16];
+    ssize_t size = transport.recv(buffer, sizeof(buffer));
+    if (size <= 0)
+    {
+        return false;
+    }
+    received.append(buffer, size);
+    return true;
+}
+
+// Reads one line of a response, without the line break
+bool Client::readLine(std::string &line)
+{
+    size_t searched = receivedOffset;
+    while (true)
+    {
+        size_t end = searched + findLineEnd(received.data() + searched, received.size() - searched);
+        if (end < received.size())
+        {
+            line.assign(received, receivedOffset, end - receivedOffset);
+            receivedOffset = end + 1;
+            return true;
+        }
+
+        // Only the bytes that arrive next have to be searched (receiveMore may move the buffer)
+        size_t pending = received.size() - receivedOffset;
+        if (!receiveMore())
+        {
+            return false;
+        }
+        searched = receivedOffset + pending;
+    }
+}
+
+// Reads exactly length bytes of a response
+bool Client::readBytes(size_t length, std::string &data)
+{
+    while (received.size() - receivedOffset < length)
+    {
+        if (!receiveMore())
+        {
+            return false;
+        }
+    }
+    data.assign(received, receivedOffset, length);
+    receivedOffset += length;
+    return true;
+}
+
+// Receives the complete response to a command. LIST, SEARCH and SYNC announce the number of
+// lines that follow, READ the length of the message.
+bool Client::receiveResponse(const std::string &commandName, std::string &response)
+{
+    std::string line;
+    if (!readLine(line))
+    {
+        return false;
+    }
+    response = line + "\n";
+    if (line.compare(0, 3, "ERR") == 0)
+    {
+        return true;
+    }
+
+    if (commandName == "LIST" || commandName == "SEARCH" || commandName == "SYNC")
+    {
+        // SYNC answers "FULL|DELTA <token> <count>"
+        size_t countStart = commandName == "SYNC" ? line.rfind(' ') + 1 : 0;
+        long count = strtol(line.c_str() + countStart, nullptr, 10);
+        for (long i = 0; i < count; i++)
+        {
+            if (!readLine(line))
+            {
+                return false;
+            }
+            response += line + "\n";
+        }
+    }
+    else if (commandName == "READ")
+    {
+        std::string message;
+        if (!readBytes(strtoull(line.c_str() + 2, nullptr, 10), message))
+        {
+            return false;
+        }
+        response += message;
+    }
+    return true;
 }
 
 bool Client::isValidName(const std::string &name)
+{
+    std::string reason;
+    if (!checkName(name, reason))
+    {
+        std::cout << reason << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Checks a user name without printing; reason describes the problem
+bool Client::checkName(const std::string &name, std::string &reason)
 {
     if (name.length() > 8)
     {
-        std::cout << "Max. 8 Characters allowed!\n";
+        reason = "Max. 8 Characters allowed!";
         return false;
     }
 
@@ -262,7 +560,7 @@ bool Client::isValidName(const std::string &name)
     {
         if (!islower(c) && !isdigit(c))
         {
-            std::cout << "Invalid name. Please use a name with characters a-z (lowercase) and digits 0-9. No special characters allowed!\n";
+            reason = "Invalid name. Please use a name with characters a-z (lowercase) and digits 0-9. No special characters allowed!";
             return false;
         }
     }
@@ -293,7 +591,7 @@ bool Client::isValidCommand(const std::string &command)
         printUsage();
         return false;
     }
-    if (commandName == "SEND" || commandName == "LIST" || commandName == "READ" || commandName == "DEL" || commandName == "QUIT")
+    if (commandName == "SEND" || commandName == "LIST" || commandName == "READ" || commandName == "DEL" || commandName == "SEARCH" || commandName == "SYNC" || commandName == "QUOTA" || commandName == "QUIT")
     {
         return true;
     }
@@ -308,7 +606,7 @@ bool Client::isValidCommand(const std::string &command)
 // prints the correct usage for the program
 void Client::printUsage()
 {
-    std::cerr << "Invalid command or format. Valid commands are: SEND, LIST, READ, DEL, QUIT";
+    std::cerr << "Invalid command or format. Valid commands are: SEND, LIST, READ, DEL, SEARCH, SYNC, QUOTA, QUIT";
 }
 
 // closes the client connection
@@ -316,7 +614,8 @@ void Client::closeConnection()
 {
     if (clientSocket != -1)
     {
-        if (shutdown(clientSocket, SHUT_RDWR) == -1)
+        transport.end(); // Say goodbye on the TLS session while the socket is still open
+        if (shutdown(clientSocket, SHUT_RDWR) == -1 && errno != ENOTCONN) // Not an error if the server closed first
         {
             perror("shutdown clientSocket");
         }
@@ -331,48 +630,80 @@ void Client::closeConnection()
 // receives the initial welcome message from the server to test communication
 void Client::receiveWelcomeMessageFromServer()
 {
-    char buffer[1024];
-    std::string response;
+    if (!readLine(welcomeMessage))
+    {
+        std::cout << "Server closed the connection.\n";
+    }
+}
 
-    // Clear the buffer
-    memset(buffer, 0, sizeof(buffer));
+int main(int argc, char *argv[])
+{
+    // Display correct usage for the Client
+    if (argc < 3)
+    {
+        std::cerr << "Usage: ./twmailer-client <ip> <port> [--batch <file>] [--connections <n>] [--cache <dir>] [--tls] [--tls-ca <file>]\n";
+        return EXIT_FAILURE;
+    }
 
-    // Receive data from the server
-    ssize_t bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0)
+    // Extract IP address and port
+    std::string ip = argv[1];
+    int port = std::atoi(argv[2]);
+
+    std::string scriptPath;
+    std::string cacheDir;
+    unsigned connections = 1;
+    bool useTls = false;
+    std::string caFile;
+    for (int i = 3; i < argc; i++)
     {
-        // Handle errors or closed connection
-        if (bytesReceived == 0)
+        std::string option = argv[i];
+        if (option == "--batch" && i + 1 < argc)
         {
-            std::cout << "Server closed the connection.\n";
+            scriptPath = argv[++i];
+        }
+        else if (option == "--cache" && i + 1 < argc)
+        {
+            cacheDir = argv[++i];
+        }
+        else if (option == "--tls")
+        {
+            useTls = true;
+        }
+        else if (option == "--tls-ca" && i + 1 < argc)
+        {
+            caFile = argv[++i];
+            useTls = true;
+        }
+        else if (option == "--connections" && i + 1 < argc)
+        {
+            connections = std::max(std::atoi(argv[++i]), 1);
         }
         else
         {
-            perror("Receive error");
+            std::cerr << "Usage: ./twmailer-client <ip> <port> [--batch <file>] [--connections <n>] [--cache <dir>] [--tls] [--tls-ca <file>]\n";
+            return EXIT_FAILURE;
         }
     }
 
-    // Convert the received data to a std::string
-    response = std::string(buffer);
-    // print server's response
-    std::cout << "\n<< " << response << "\n";
-}
-
-int main(int argc, char *argv[])
-{
-    // Display correct usage for the Client
-    if (argc != 3)
+    TlsContext tls;
+    if (useTls && !tls.initClient(caFile))
     {
-        std::cerr << "Usage: ./twmailer-client <ip> <port>\n";
         return EXIT_FAILURE;
     }
 
-    // Extract IP address and port
-    std::string ip = argv[1];
-    int port = std::stoi(argv[2]);
+    // Run a script without prompts
+    if (!scriptPath.empty())
+    {
+        return runBatch(ip, port, scriptPath, connections, useTls ? &tls : nullptr) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     // Create client
-    Client client(ip, port);
+    Client client(ip, port, useTls ? &tls : nullptr);
+    if (!cacheDir.empty())
+    {
+        client.setCache(cacheDir);
+    }
+    client.handleCommunication();
 
     return EXIT_SUCCESS;
 }
@@ -3,28 +3,47 @@
 
 #include <string>
 #include <sstream>
+#include <memory>
+#include "twmailer-cache.h"
+#include "twmailer-tls.h"
 
 class Client {
 public:
-    Client(std::string ip, int port);
+    Client(std::string ip, int port, TlsContext* tls = nullptr);
     ~Client();
 
+    void handleCommunication(); // Interactive prompt on stdin
+    void setCache(const std::string& directory); // Serve LIST, READ and DEL from a local cache
+    bool sendCommand(const std::string& command);
+    bool receiveResponse(const std::string& commandName, std::string& response);
+    static bool checkName(const std::string& name, std::string& reason);
+
 private:
     int createClientSocket();
     void connectToServer();
-    void handleCommunication();
     void closeConnection();
     void receiveWelcomeMessageFromServer();
     bool isValidCommand(const std::string& command);
     void printUsage();
     bool isValidName(const std::string& name);
+    bool receiveMore();
+    bool readLine(std::string& line);
+    bool readBytes(size_t length, std::string& data);
+    std::string promptUsername();
+    bool syncMailbox(const std::string& username, std::vector<CachedMessage>& messages, bool force);
+    bool handleCachedCommand(const std::string& command);
     
 
 
 private:
     int clientSocket;
+    TlsSocket transport; // Plain unless the client was created with a TLS context
     std::string ip;
     int port;
+    std::string welcomeMessage;
+    std::string received;  // Received data; everything before receivedOffset was consumed
+    size_t receivedOffset;
+    std::unique_ptr<MailCache> cache; // Only set with --cache
     
 
 };
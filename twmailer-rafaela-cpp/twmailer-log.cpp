@@ -0,0 +1,490 @@
+#include "twmailer-log.h"
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 512        // Records a thread can queue before the writer catches up
+#define LOG_FLUSH_MS 50          // The writer collects the queued records this often
+#define LOG_BURST_PER_SECOND 10  // Warnings or errors per event name written per second
+
+namespace
+{
+
+struct LogEntry {
+    int64_t time; // Microseconds since the epoch
+    LogLevel level;
+    const char *event;
+    std::string fields;
+};
+
+// Single producer (the owning thread), single consumer (the writer). The owner only
+// advances head, the writer only advances tail, so neither needs a lock.
+struct LogRing {
+    LogEntry entries[LOG_RING_SIZE];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<bool> closed{false}; // The thread ended; the writer frees the ring once it is empty
+};
+
+// Marks the ring of a thread as closed when the thread ends
+struct RingOwner {
+    std::shared_ptr<LogRing> ring;
+    ~RingOwner()
+    {
+        if (ring)
+        {
+            ring->closed = true;
+        }
+    }
+};
+
+// Counts the warnings or errors of one event name in the current second
+struct Burst {
+    int64_t second = 0;
+    unsigned written = 0;
+    uint64_t suppressed = 0;
+};
+
+LogOptions settings;
+std::atomic<int> minimumLevel(static_cast<int>(LogLevel::Info));
+std::atomic<bool> running(false);
+std::atomic<uint64_t> dropped(0);
+int outputFd = STDERR_FILENO;
+
+std::mutex ringsLock; // Taken once per thread to register its ring, and by the writer
+std::vector<std::shared_ptr<LogRing>> rings;
+thread_local RingOwner owner;
+
+std::mutex burstLock;
+std::map<std::string, Burst> bursts;
+
+std::mutex writerLock;
+std::condition_variable stopRequested;
+bool stopping = false;
+std::thread writer;
+
+std::mutex directLock; // Serializes records written without the writer thread
+
+const char *levelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Debug:
+        return "debug";
+    case LogLevel::Info:
+        return "info";
+    case LogLevel::Warning:
+        return "warning";
+    default:
+        return "error";
+    }
+}
+
+int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// False if the event already had its share of warnings or errors this second. Otherwise
+// returns how many were suppressed since the last one that was written.
+bool allowBurst(const char *event, int64_t time, uint64_t &suppressed)
+{
+    std::lock_guard<std::mutex> guard(burstLock);
+    Burst &burst = bursts[event];
+    if (burst.second != time / 1000000)
+    {
+        burst.second = time / 1000000;
+        burst.written = 0;
+    }
+    if (burst.written >= LOG_BURST_PER_SECOND)
+    {
+        burst.suppressed++;
+        return false;
+    }
+    burst.written++;
+    suppressed = burst.suppressed;
+    burst.suppressed = 0;
+    return true;
+}
+
+void appendTime(std::string &out, int64_t time)
+{
+    time_t seconds = time / 1000000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char text[40];
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(text + length, sizeof(text) - length, ".%06dZ", static_cast<int>(time % 1000000));
+    out += text;
+}
+
+void appendJsonString(std::string &out, const char *data, size_t length)
+{
+    out += '"';
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = data[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Plain values stay as they are; values with spaces, quotes, '=' or control characters are quoted
+void appendKeyValue(std::string &out, const char *data, size_t length)
+{
+    bool plain = length > 0;
+    for (size_t i = 0; i < length && plain; i++)
+    {
+        unsigned char c = data[i];
+        plain = c > ' ' && c != '"' && c != '=' && c != 0x7f;
+    }
+    if (plain)
+    {
+        out.append(data, length);
+        return;
+    }
+    out += '"';
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = data[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\x%02x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Fields are stored as <key>\0<'n' or 's'><4 byte length><value>; numbers stay unquoted in JSON
+void encodeField(std::string &fields, const char *key, const std::string &value, bool number)
+{
+    uint32_t length = value.size();
+    fields.append(key, strlen(key) + 1);
+    fields += number ? 'n' : 's';
+    fields.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    fields += value;
+}
+
+void appendField(std::string &out, const char *key, const char *value, size_t length, bool number)
+{
+    if (settings.json)
+    {
+        out += ',';
+        appendJsonString(out, key, strlen(key));
+        out += ':';
+        if (number)
+        {
+            out.append(value, length);
+        }
+        else
+        {
+            appendJsonString(out, value, length);
+        }
+    }
+    else
+    {
+        out += ' ';
+        out += key;
+        out += '=';
+        appendKeyValue(out, value, length);
+    }
+}
+
+void render(std::string &out, const LogEntry &entry)
+{
+    std::string time;
+    appendTime(time, entry.time);
+    if (settings.json)
+    {
+        out += "{\"time\":\"" + time + "\",\"level\":\"" + levelName(entry.level) + "\",\"event\":";
+        appendJsonString(out, entry.event, strlen(entry.event));
+    }
+    else
+    {
+        out += "time=" + time + " level=" + levelName(entry.level) + " event=";
+        appendKeyValue(out, entry.event, strlen(entry.event));
+    }
+
+    size_t offset = 0;
+    while (offset < entry.fields.size())
+    {
+        const char *key = entry.fields.data() + offset;
+        offset += strlen(key) + 1;
+        bool number = entry.fields[offset++] == 'n';
+        uint32_t length;
+        memcpy(&length, entry.fields.data() + offset, sizeof(length));
+        offset += sizeof(length);
+        appendField(out, key, entry.fields.data() + offset, length, number);
+        offset += length;
+    }
+    out += settings.json ? "}\n" : "\n";
+}
+
+void writeAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t bytes = write(fd, data.data() + written, data.size() - written);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return; // Nowhere left to report it
+        }
+        written += bytes;
+    }
+}
+
+LogRing *threadRing()
+{
+    if (!owner.ring)
+    {
+        owner.ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> guard(ringsLock);
+        rings.push_back(owner.ring);
+    }
+    return owner.ring.get();
+}
+
+void submit(LogEntry &entry)
+{
+    if (!running)
+    {
+        std::string line;
+        render(line, entry);
+        std::lock_guard<std::mutex> guard(directLock);
+        writeAll(STDERR_FILENO, line);
+        return;
+    }
+
+    LogRing *ring = threadRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SIZE)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogEntry &slot = ring->entries[head % LOG_RING_SIZE];
+    slot.time = entry.time;
+    slot.level = entry.level;
+    slot.event = entry.event;
+    slot.fields.swap(entry.fields);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Takes the queued records of all threads, oldest first, and writes them with one call
+void flush()
+{
+    std::vector<std::shared_ptr<LogRing>> current;
+    {
+        std::lock_guard<std::mutex> guard(ringsLock);
+        current = rings;
+    }
+
+    std::vector<LogEntry> entries;
+    for (const std::shared_ptr<LogRing> &ring : current)
+    {
+        bool closed = ring->closed; // Read first: records queued before closing are taken below
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail < head; tail++)
+        {
+            LogEntry &slot = ring->entries[tail % LOG_RING_SIZE];
+            entries.push_back(LogEntry{slot.time, slot.level, slot.event, std::string()});
+            entries.back().fields.swap(slot.fields);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        if (closed)
+        {
+            std::lock_guard<std::mutex> guard(ringsLock);
+            rings.erase(std::find(rings.begin(), rings.end(), ring));
+        }
+    }
+
+    uint64_t lost = dropped.exchange(0);
+    if (lost > 0)
+    {
+        LogEntry entry = {now(), LogLevel::Warning, "log.dropped", std::string()};
+        encodeField(entry.fields, "records", std::to_string(lost), true);
+        entries.push_back(entry);
+    }
+    if (entries.empty())
+    {
+        return;
+    }
+
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const LogEntry &a, const LogEntry &b) { return a.time < b.time; });
+    std::string out;
+    for (const LogEntry &entry : entries)
+    {
+        render(out, entry);
+    }
+    writeAll(outputFd, out);
+}
+
+void runWriter()
+{
+    std::unique_lock<std::mutex> guard(writerLock);
+    while (!stopping)
+    {
+        stopRequested.wait_for(guard, std::chrono::milliseconds(LOG_FLUSH_MS));
+        guard.unlock();
+        flush();
+        guard.lock();
+    }
+}
+
+} // namespace
+
+LogRecord::LogRecord(LogLevel level, const char *event)
+    : enabled(static_cast<int>(level) >= minimumLevel.load(std::memory_order_relaxed)), level(level), event(event)
+{
+}
+
+LogRecord::~LogRecord()
+{
+    if (!enabled)
+    {
+        return;
+    }
+    LogEntry entry = {now(), level, event, std::string()};
+    if (level >= LogLevel::Warning)
+    {
+        uint64_t suppressed;
+        if (!allowBurst(event, entry.time, suppressed))
+        {
+            return;
+        }
+        if (suppressed > 0)
+        {
+            field("suppressed", suppressed);
+        }
+    }
+    entry.fields.swap(fields);
+    submit(entry);
+}
+
+LogRecord &LogRecord::field(const char *key, const std::string &value)
+{
+    return append(key, value, false);
+}
+
+LogRecord &LogRecord::field(const char *key, const char *value)
+{
+    return enabled ? append(key, value, false) : *this;
+}
+
+LogRecord &LogRecord::append(const char *key, const std::string &value, bool number)
+{
+    if (enabled)
+    {
+        encodeField(fields, key, value, number);
+    }
+    return *this;
+}
+
+bool Log::start(const LogOptions &options)
+{
+    settings = options;
+    minimumLevel = static_cast<int>(options.level);
+    if (!options.path.empty())
+    {
+        outputFd = open(options.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (outputFd == -1)
+        {
+            perror("Error opening log file");
+            return false;
+        }
+    }
+    else
+    {
+        outputFd = STDOUT_FILENO;
+    }
+
+    running = true;
+    writer = std::thread(runWriter);
+    atexit(Log::stop); // exit() in an error path still writes what was queued
+    return true;
+}
+
+void Log::stop()
+{
+    if (!writer.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    writer.join();
+    running = false;
+    flush(); // Records queued while the writer was finishing
+    if (outputFd != STDOUT_FILENO)
+    {
+        close(outputFd);
+    }
+    outputFd = STDERR_FILENO;
+}
+
+bool Log::parseLevel(const std::string &name, LogLevel &level)
+{
+    static const LogLevel levels[] = {LogLevel::Debug, LogLevel::Info, LogLevel::Warning, LogLevel::Error};
+    for (LogLevel candidate : levels)
+    {
+        if (name == levelName(candidate))
+        {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
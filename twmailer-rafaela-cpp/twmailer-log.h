@@ -0,0 +1,78 @@
+#ifndef LOG_H
+#define LOG_H
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <type_traits>
+
+enum class LogLevel { Debug, Info, Warning, Error };
+
+// Where and how records are written; set once by Log::start
+struct LogOptions {
+    LogLevel level = LogLevel::Info;
+    bool json = false; // One JSON object per line instead of key=value pairs
+    std::string path;  // Appended to; empty for stdout
+};
+
+// One structured record: an event name and key-value fields. The record is queued when
+// it goes out of scope, usually at the end of the statement that built it:
+//
+//     LOG_INFO("session.opened").field("socket", clientSocket);
+//
+// Records below the configured level cost one comparison; their fields are not stored.
+class LogRecord {
+public:
+    LogRecord(LogLevel level, const char* event);
+    ~LogRecord();
+    LogRecord(const LogRecord&) = delete;
+    LogRecord& operator=(const LogRecord&) = delete;
+
+    LogRecord& field(const char* key, const std::string& value);
+    LogRecord& field(const char* key, const char* value);
+    template <typename Number, typename = typename std::enable_if<std::is_arithmetic<Number>::value>::type>
+    LogRecord& field(const char* key, Number value)
+    {
+        return enabled ? append(key, std::to_string(value), true) : *this;
+    }
+
+private:
+    LogRecord& append(const char* key, const std::string& value, bool number);
+
+    bool enabled;
+    LogLevel level;
+    const char* event;
+    std::string fields; // Encoded by the record, rendered by the writer
+};
+
+// Asynchronous log: every thread queues its records in its own lock-free ring buffer,
+// a background thread formats and writes them in batches. A full ring drops records
+// instead of blocking the thread; the writer reports how many were dropped. Warnings
+// and errors are limited per event name, a burst of them is summarized afterwards.
+// Before start and after stop records are written to stderr right away.
+class Log {
+public:
+    static bool start(const LogOptions& options);
+    static void stop(); // Writes the queued records; also called at exit
+
+    static bool parseLevel(const std::string& name, LogLevel& level);
+};
+
+#define LOG_INFO(event) LogRecord(LogLevel::Info, event)
+#define LOG_WARNING(event) LogRecord(LogLevel::Warning, event)
+#define LOG_ERROR(event) LogRecord(LogLevel::Error, event)
+
+// Debug records only exist in builds with make DEBUG_LOG=1; otherwise the statement
+// is dead code and neither the record nor its fields are evaluated
+#ifdef TWMAILER_DEBUG_LOG
+#define LOG_DEBUG(event) LogRecord(LogLevel::Debug, event)
+#else
+#define LOG_DEBUG(event) \
+    if (true)            \
+    {                    \
+    }                    \
+    else                 \
+        LogRecord(LogLevel::Debug, event)
+#endif
+
+#endif // LOG_H
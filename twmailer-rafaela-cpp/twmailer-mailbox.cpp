@@ -0,0 +1,1077 @@
+#include "twmailer-mailbox.h"
+#include "twmailer-log.h"
+#include "twmailer-trace.h"
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <deque>
+
+#define DIRENT_BATCH 65536       // Bytes fetched per getdents64 call
+#define SUBJECT_SCAN_LIMIT 65536 // Stop looking for the subject line after this many bytes
+#define JOURNAL_NAME ".index"
+#define SEARCH_JOURNAL_NAME ".search"
+#define CHANGE_HISTORY 4096      // Changes kept per mailbox for SYNC; older tokens get the whole index
+
+static const std::string subjectPrefix = "Subject: ";
+
+// Reads all entries of a directory in large batches; skips hidden entries unless asked for them.
+// The directory is read through a descriptor of its own, since the read position of dirFd
+// is shared with every other thread using it.
+static std::vector<std::pair<std::string, unsigned char>> readDirectory(int dirFd, bool includeHidden = false)
+{
+    std::vector<std::pair<std::string, unsigned char>> result;
+    std::vector<char> buffer(DIRENT_BATCH);
+    int listFd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (listFd == -1)
+    {
+        return result;
+    }
+
+    while (true)
+    {
+        long bytes = syscall(SYS_getdents64, listFd, buffer.data(), buffer.size());
+        if (bytes <= 0)
+        {
+            break; // End of directory or error
+        }
+        for (long offset = 0; offset < bytes;)
+        {
+            struct dirent64 *entry = reinterpret_cast<struct dirent64 *>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            if (entry->d_name[0] == '.' &&
+                (!includeHidden || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0))
+            {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                // Some filesystems do not report the type
+                struct stat st;
+                if (fstatat(dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                {
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+                }
+            }
+            result.push_back(std::make_pair(std::string(entry->d_name), type));
+        }
+    }
+    close(listFd);
+    return result;
+}
+
+// Reads a whole file relative to a directory descriptor
+static bool readWholeFile(int dirFd, const char *name, std::string &content)
+{
+    int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+    char buffer[8192];
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        content.append(buffer, bytes);
+    }
+    close(fd);
+    return bytes == 0;
+}
+
+// Copies a regular file with sendfile and makes the copy durable
+static bool copyFile(int fromDirFd, int toDirFd, const char *name)
+{
+    int in = openat(fromDirFd, name, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+    {
+        return false;
+    }
+    struct stat st;
+    int out = openat(toDirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = out != -1 && fstat(in, &st) == 0;
+    off_t offset = 0;
+    while (ok && offset < st.st_size)
+    {
+        ok = sendfile(out, in, &offset, st.st_size - offset) > 0;
+    }
+    ok = ok && fsync(out) == 0;
+    close(in);
+    if (out != -1)
+    {
+        close(out);
+    }
+    return ok;
+}
+
+// Copies a mailbox directory (messages and journal) to another spool root under a new name
+static bool copyMailbox(int fromRootFd, const char *name, int toRootFd, const char *target)
+{
+    int fromFd = openat(fromRootFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fromFd == -1)
+    {
+        return false;
+    }
+    int toFd = -1;
+    if (mkdirat(toRootFd, target, 0777) == 0)
+    {
+        toFd = openat(toRootFd, target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    bool ok = toFd != -1;
+    for (const auto &entry : readDirectory(fromFd, true))
+    {
+        // Unfinished SENDs are not worth moving
+        if (!ok || entry.second != DT_REG || entry.first.compare(0, 10, ".incoming-") == 0)
+        {
+            continue;
+        }
+        ok = copyFile(fromFd, toFd, entry.first.c_str());
+    }
+    ok = ok && fsync(toFd) == 0;
+    close(fromFd);
+    if (toFd != -1)
+    {
+        close(toFd);
+    }
+    return ok;
+}
+
+// Deletes a mailbox directory and its files; mailbox directories have no subdirectories
+static bool removeMailbox(int rootFd, const char *name)
+{
+    int dirFd = openat(rootFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1)
+    {
+        return errno == ENOENT;
+    }
+    for (const auto &entry : readDirectory(dirFd, true))
+    {
+        unlinkat(dirFd, entry.first.c_str(), 0);
+    }
+    close(dirFd);
+    return unlinkat(rootFd, name, AT_REMOVEDIR) == 0;
+}
+
+MailboxStore::MailboxStore() : stopping(false)
+{
+}
+
+MailboxStore::~MailboxStore()
+{
+    stop();
+    for (int fd : shardFds)
+    {
+        close(fd);
+    }
+}
+
+// Opens the spool roots; mailbox directories are then opened relative to them
+bool MailboxStore::open(const std::vector<std::string> &roots, unsigned ioThreads)
+{
+    epoch = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (!shards.open(roots))
+    {
+        return false;
+    }
+    for (unsigned shard = 0; shard < shards.size(); shard++)
+    {
+        int fd = ::open(shards.root(shard).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            perror("Error opening mail spool directory");
+            return false;
+        }
+        shardFds.push_back(fd);
+        ioQueues.push_back(std::unique_ptr<IoQueue>(new IoQueue(ioThreads)));
+    }
+
+    std::vector<std::pair<std::string, unsigned>> leftovers = scanShards();
+    if (!leftovers.empty() || !shards.pending().empty())
+    {
+        rebalanceThread = std::thread(&MailboxStore::runRebalance, this, leftovers);
+    }
+    return true;
+}
+
+// Finds mailboxes that are not on the shard the ring assigns them to, which happens after
+// a shard was added or a move was interrupted. Those are pinned to where they are until the
+// rebalancer moves them; copies left behind by an interrupted move are returned for deletion.
+std::vector<std::pair<std::string, unsigned>> MailboxStore::scanShards()
+{
+    std::vector<std::pair<std::string, unsigned>> leftovers;
+    for (unsigned shard = 0; shard < shards.size(); shard++)
+    {
+        for (const auto &entry : readDirectory(shardFds[shard], true))
+        {
+            if (entry.second != DT_DIR)
+            {
+                continue;
+            }
+            if (entry.first.compare(0, 8, ".moving-") == 0)
+            {
+                leftovers.push_back(std::make_pair(entry.first, shard)); // Unfinished copy
+                continue;
+            }
+            if (entry.first[0] == '.')
+            {
+                continue;
+            }
+
+            unsigned current = shards.locate(entry.first);
+            struct stat st;
+            if (current == shard)
+            {
+                continue;
+            }
+            if (fstatat(shardFds[current], entry.first.c_str(), &st, 0) == 0)
+            {
+                leftovers.push_back(std::make_pair(entry.first, shard)); // Moved, but not deleted yet
+            }
+            else
+            {
+                shards.pin(entry.first, shard);
+            }
+        }
+    }
+
+    // Forget pins of mailboxes that do not exist anywhere
+    for (const auto &pin : shards.pending())
+    {
+        struct stat st;
+        if (fstatat(shardFds[pin.second], pin.first.c_str(), &st, 0) != 0)
+        {
+            shards.pin(pin.first, shards.placement(pin.first));
+        }
+    }
+    shards.save();
+    return leftovers;
+}
+
+// Moves the pinned mailboxes to their shards one by one while the server keeps running.
+// A mailbox that is in use is skipped and tried again later.
+void MailboxStore::runRebalance(std::vector<std::pair<std::string, unsigned>> leftovers)
+{
+    for (const auto &leftover : leftovers)
+    {
+        int rootFd = shardFds[leftover.second];
+        const char *name = leftover.first.c_str();
+        ioQueues[leftover.second]->run([&]() { return removeMailbox(rootFd, name); });
+    }
+
+    std::deque<std::pair<std::string, unsigned>> moves;
+    for (const auto &pin : shards.pending())
+    {
+        moves.push_back(pin);
+    }
+    if (moves.empty())
+    {
+        return;
+    }
+    LOG_INFO("rebalance.started").field("mailboxes", moves.size());
+
+    auto started = std::chrono::steady_clock::now();
+    size_t moved = 0;
+    size_t failed = 0;
+    while (!stopping && !moves.empty())
+    {
+        std::pair<std::string, unsigned> move = moves.front();
+        moves.pop_front();
+
+        std::shared_ptr<Mailbox> mailbox = get(move.first);
+        {
+            std::lock_guard<std::mutex> guard(mailbox->lock);
+            if (mailbox->busy == 0)
+            {
+                if (moveMailbox(*mailbox, shards.placement(move.first)))
+                {
+                    moved++;
+                }
+                else
+                {
+                    failed++; // Stays pinned and is retried at the next start
+                }
+                continue;
+            }
+        }
+        moves.push_back(move);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    LOG_INFO("rebalance.finished").field("moved", moved).field("failed", failed).field("ms", elapsed.count());
+}
+
+// Moves a mailbox to another shard; the caller holds mailbox.lock and the mailbox is not busy.
+// Within one filesystem the directory is renamed. Across filesystems it is copied under a
+// hidden name, renamed into place, recorded in the manifest and only then deleted.
+bool MailboxStore::moveMailbox(Mailbox &mailbox, unsigned target)
+{
+    unsigned source = mailbox.shard;
+    int sourceFd = shardFds[source];
+    int targetFd = shardFds[target];
+    const char *name = mailbox.user.c_str();
+    std::string temporary = ".moving-" + mailbox.user;
+
+    struct stat sourceStat, targetStat;
+    bool sameDevice = fstat(sourceFd, &sourceStat) == 0 && fstat(targetFd, &targetStat) == 0 &&
+                      sourceStat.st_dev == targetStat.st_dev;
+    bool moved = ioQueues[target]->run([&]() {
+        // A copy already on the target is left over from an interrupted move
+        removeMailbox(targetFd, name);
+        if (sameDevice)
+        {
+            return renameat(sourceFd, name, targetFd, name) == 0 && fsync(targetFd) == 0 && fsync(sourceFd) == 0;
+        }
+        removeMailbox(targetFd, temporary.c_str());
+        return copyMailbox(sourceFd, name, targetFd, temporary.c_str()) &&
+               renameat(targetFd, temporary.c_str(), targetFd, name) == 0 && fsync(targetFd) == 0;
+    });
+    if (!moved)
+    {
+        LOG_ERROR("rebalance.move_failed").field("user", mailbox.user).field("shard", target).field("error", strerror(errno));
+        removeMailbox(targetFd, temporary.c_str());
+        return false;
+    }
+
+    mailbox.shard = target;
+    shards.pin(mailbox.user, target);
+    shards.save();
+    if (!sameDevice)
+    {
+        ioQueues[source]->run([&]() { return removeMailbox(sourceFd, name); });
+    }
+    return true;
+}
+
+int MailboxStore::openMailbox(const Mailbox &mailbox)
+{
+    return openat(shardFds[mailbox.shard], mailbox.user.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+std::string MailboxStore::directory(const Mailbox &mailbox)
+{
+    return shards.root(mailbox.shard) + "/" + mailbox.user;
+}
+
+IoQueue &MailboxStore::io(const Mailbox &mailbox)
+{
+    return *ioQueues[mailbox.shard];
+}
+
+bool MailboxStore::isValidUser(const std::string &user)
+{
+    if (user.empty() || user.length() > NAME_MAX || user[0] == '.')
+    {
+        return false;
+    }
+    for (unsigned char c : user)
+    {
+        if (c <= ' ' || c == '/' || c == 0x7f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<Mailbox> MailboxStore::get(const std::string &user)
+{
+    if (!isValidUser(user))
+    {
+        return nullptr;
+    }
+
+    TraceSpan span(TracePhase::Lookup);
+    std::lock_guard<std::mutex> guard(mailboxesLock);
+    std::shared_ptr<Mailbox> &mailbox = mailboxes[user];
+    if (!mailbox)
+    {
+        mailbox = std::make_shared<Mailbox>();
+        mailbox->user = user;
+        mailbox->shard = shards.locate(user);
+    }
+    return mailbox;
+}
+
+bool MailboxStore::load(Mailbox &mailbox)
+{
+    if (mailbox.loaded)
+    {
+        return true;
+    }
+
+    TraceSpan span(TracePhase::Disk);
+    int dirFd = openMailbox(mailbox);
+    if (dirFd == -1)
+    {
+        return false; // No inbox yet
+    }
+
+    bool journalValid = readJournal(dirFd, mailbox);
+
+    // Validate the journal against the files that are actually there
+    std::vector<std::string> files;
+    for (const auto &entry : readDirectory(dirFd))
+    {
+        if (entry.second == DT_REG)
+        {
+            files.push_back(entry.first);
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    bool changed = !journalValid;
+    std::vector<MailEntry> kept;
+    for (const MailEntry &entry : mailbox.entries)
+    {
+        if (std::binary_search(files.begin(), files.end(), entry.filename))
+        {
+            kept.push_back(entry);
+        }
+        else
+        {
+            changed = true; // File was removed behind our back
+        }
+    }
+
+    std::vector<std::string> known;
+    for (const MailEntry &entry : kept)
+    {
+        known.push_back(entry.filename);
+    }
+    std::sort(known.begin(), known.end());
+
+    // Files that are missing from the journal are indexed in arrival order
+    std::vector<MailEntry> added;
+    for (const std::string &file : files)
+    {
+        MailEntry entry;
+        if (!std::binary_search(known.begin(), known.end(), file) && indexFile(dirFd, file, entry))
+        {
+            added.push_back(entry);
+        }
+    }
+    std::sort(added.begin(), added.end(), [](const MailEntry &a, const MailEntry &b) {
+        return a.mtime != b.mtime ? a.mtime < b.mtime : a.filename < b.filename;
+    });
+    for (MailEntry &entry : added)
+    {
+        entry.id = mailbox.nextId++;
+        kept.push_back(entry);
+        changed = true;
+    }
+
+    mailbox.entries.swap(kept);
+
+    // The journal records the sizes, so the usage is known without a stat of every message
+    mailbox.bytes = 0;
+    for (const MailEntry &entry : mailbox.entries)
+    {
+        mailbox.bytes += entry.size;
+        scheduleExpiry(mailbox, entry);
+    }
+
+    // Rewrite the journal when it was repaired or has collected too many deletions
+    if (changed || mailbox.journalRecords > 2 * mailbox.entries.size() + 64)
+    {
+        writeJournal(dirFd, mailbox);
+    }
+
+    close(dirFd);
+    mailbox.loaded = true;
+    return true;
+}
+
+// Replays the journal into mailbox.entries; returns false if it is missing or damaged.
+// Records before a damaged one are kept.
+bool MailboxStore::readJournal(int dirFd, Mailbox &mailbox)
+{
+    mailbox.entries.clear();
+    mailbox.journalRecords = 0;
+
+    std::string content;
+    if (!readWholeFile(dirFd, JOURNAL_NAME, content))
+    {
+        return false;
+    }
+
+    std::map<uint32_t, MailEntry> entries;
+    bool valid = true;
+    size_t start = 0;
+    while (valid && start < content.size())
+    {
+        size_t end = content.find('\n', start);
+        if (end == std::string::npos)
+        {
+            valid = false; // Torn write at the end
+            break;
+        }
+        std::string line = content.substr(start, end - start);
+        start = end + 1;
+        mailbox.journalRecords++;
+
+        char *next = nullptr;
+        uint32_t id = line.size() > 1 ? strtoul(line.c_str() + 1, &next, 10) : 0;
+        if (id == 0)
+        {
+            valid = false;
+        }
+        else if (line[0] == '-')
+        {
+            entries.erase(id);
+            mailbox.nextId = std::max(mailbox.nextId, id + 1);
+        }
+        else if (line[0] == 'n')
+        {
+            // n<next id> starts a compacted journal, which has no records of the deleted IDs
+            mailbox.nextId = std::max(mailbox.nextId, id);
+        }
+        else if (line[0] == '@')
+        {
+            // @<id>\t<expires> follows the record of a message sent with a TTL
+            auto it = entries.find(id);
+            if (it != entries.end())
+            {
+                it->second.expires = strtoll(next, nullptr, 10);
+            }
+        }
+        else if (line[0] == '+')
+        {
+            // +<id>\t<size>\t<mtime>\t<filename>\t<subject>
+            MailEntry entry;
+            entry.id = id;
+            entry.size = strtoull(next, &next, 10);
+            entry.mtime = strtoll(next, &next, 10);
+            const char *filename = *next == '\t' ? next + 1 : nullptr;
+            const char *tab = filename != nullptr ? strchr(filename, '\t') : nullptr;
+            if (tab == nullptr)
+            {
+                valid = false;
+                break;
+            }
+            entry.filename.assign(filename, tab);
+            entry.subject.assign(tab + 1);
+            entries[id] = entry;
+            mailbox.nextId = std::max(mailbox.nextId, id + 1);
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+
+    for (const auto &entry : entries)
+    {
+        mailbox.entries.push_back(entry.second);
+    }
+    return valid;
+}
+
+static std::string addRecord(const MailEntry &entry)
+{
+    std::string record = "+" + std::to_string(entry.id) + "\t" + std::to_string(entry.size) + "\t" +
+                         std::to_string(entry.mtime) + "\t" + entry.filename + "\t" + entry.subject + "\n";
+    if (entry.expires != 0)
+    {
+        record += "@" + std::to_string(entry.id) + "\t" + std::to_string(entry.expires) + "\n";
+    }
+    return record;
+}
+
+// Writes a compacted journal and atomically replaces the old one
+void MailboxStore::writeJournal(int dirFd, Mailbox &mailbox)
+{
+    TraceSpan span(TracePhase::Disk);
+    std::string content = "n" + std::to_string(mailbox.nextId) + "\n";
+    for (const MailEntry &entry : mailbox.entries)
+    {
+        content += addRecord(entry);
+    }
+
+    const char *tmpName = JOURNAL_NAME ".tmp";
+    int fd = openat(dirFd, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        LOG_ERROR("index.write_failed").field("user", mailbox.user).field("error", strerror(errno));
+        return;
+    }
+    bool ok = write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size());
+    close(fd);
+    if (!ok || renameat(dirFd, tmpName, dirFd, JOURNAL_NAME) != 0)
+    {
+        LOG_ERROR("index.write_failed").field("user", mailbox.user).field("error", strerror(errno));
+        unlinkat(dirFd, tmpName, 0);
+        return;
+    }
+    mailbox.journalRecords = mailbox.entries.size() + 1;
+}
+
+// Appends a record to one of the journals of a mailbox
+static bool appendRecord(const std::string &path, const std::string &record)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    bool ok = fd != -1 && write(fd, record.data(), record.size()) == static_cast<ssize_t>(record.size());
+    int error = errno;
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    errno = error;
+    return ok;
+}
+
+void MailboxStore::appendJournal(Mailbox &mailbox, const std::string &record)
+{
+    TraceSpan span(TracePhase::Disk);
+    if (!appendRecord(directory(mailbox) + "/" JOURNAL_NAME, record))
+    {
+        LOG_ERROR("index.append_failed").field("user", mailbox.user).field("error", strerror(errno));
+    }
+    mailbox.journalRecords++;
+}
+
+// Reads size, time and subject of a message file that is not in the journal yet
+bool MailboxStore::indexFile(int dirFd, const std::string &filename, MailEntry &entry)
+{
+    int fd = openat(dirFd, filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    entry.filename = filename;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.subject.clear();
+
+    // The headers are at the top, so only the beginning of the file is needed
+    std::string head;
+    char buffer[4096];
+    ssize_t bytes;
+    while (head.size() < SUBJECT_SCAN_LIMIT && (bytes = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        head.append(buffer, bytes);
+        size_t position = head.compare(0, subjectPrefix.size(), subjectPrefix) == 0 ? 0 : head.find("\n" + subjectPrefix);
+        if (position != std::string::npos)
+        {
+            size_t start = position == 0 ? subjectPrefix.size() : position + 1 + subjectPrefix.size();
+            size_t end = head.find('\n', start);
+            if (end != std::string::npos)
+            {
+                entry.subject = head.substr(start, end - start);
+                break;
+            }
+        }
+    }
+    close(fd);
+    return true;
+}
+
+static std::string termsRecord(uint32_t id, const std::vector<std::string> &terms)
+{
+    std::string record = "+" + std::to_string(id) + "\t";
+    for (size_t i = 0; i < terms.size(); i++)
+    {
+        record += (i == 0 ? "" : " ") + terms[i];
+    }
+    return record + "\n";
+}
+
+// Reads the term journal of the mailbox; afterwards SEND and DEL keep the index current.
+// Messages without a record (stored before the journal existed, or a torn append) are read
+// once and get one. Records of deleted messages are dropped when they make up a noticeable share.
+void MailboxStore::loadSearch(Mailbox &mailbox)
+{
+    if (mailbox.searchLoaded)
+    {
+        return;
+    }
+
+    TraceSpan span(TracePhase::Disk);
+    int dirFd = openMailbox(mailbox);
+    if (dirFd == -1)
+    {
+        return;
+    }
+
+    // +<id>\t<term> <term> ...; a later record of an ID replaces an earlier one
+    std::map<uint32_t, std::vector<std::string>> documents;
+    std::string content;
+    size_t records = 0;
+    bool valid = readWholeFile(dirFd, SEARCH_JOURNAL_NAME, content);
+    size_t start = 0;
+    while (valid && start < content.size())
+    {
+        size_t end = content.find('\n', start);
+        char *next = nullptr;
+        uint32_t id = content[start] == '+' ? strtoul(content.c_str() + start + 1, &next, 10) : 0;
+        if (end == std::string::npos || id == 0 || *next != '\t')
+        {
+            valid = false; // Torn write at the end or damaged record
+            break;
+        }
+        records++;
+        if (findMessage(mailbox, id) != -1)
+        {
+            std::vector<std::string> &terms = documents[id];
+            terms.clear();
+            const char *term = next + 1;
+            const char *lineEnd = content.c_str() + end;
+            while (term < lineEnd)
+            {
+                const char *space = std::find(term, lineEnd, ' ');
+                if (space != term)
+                {
+                    terms.push_back(std::string(term, space));
+                }
+                term = space + 1;
+            }
+        }
+        start = end + 1;
+    }
+
+    bool changed = !valid;
+    for (const MailEntry &entry : mailbox.entries)
+    {
+        if (documents.count(entry.id) == 0 && readTerms(dirFd, entry, documents[entry.id]))
+        {
+            changed = true;
+        }
+    }
+    if (changed || records > documents.size() + documents.size() / 4 + 64)
+    {
+        writeSearchJournal(dirFd, mailbox, documents);
+    }
+    close(dirFd);
+
+    mailbox.search.clear();
+    for (const auto &document : documents)
+    {
+        mailbox.search.addDocument(document.first, document.second);
+    }
+    mailbox.searchLoaded = true;
+}
+
+// Collects the search terms of a message file, reading it in pieces
+bool MailboxStore::readTerms(int dirFd, const MailEntry &entry, std::vector<std::string> &terms)
+{
+    int fd = openat(dirFd, entry.filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+    DocumentTerms document;
+    char buffer[65536];
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        document.feed(buffer, bytes);
+    }
+    terms = document.finish();
+    close(fd);
+    return true;
+}
+
+// Writes a compacted term journal and atomically replaces the old one
+void MailboxStore::writeSearchJournal(int dirFd, Mailbox &mailbox, const std::map<uint32_t, std::vector<std::string>> &documents)
+{
+    std::string content;
+    for (const auto &document : documents)
+    {
+        content += termsRecord(document.first, document.second);
+    }
+
+    const char *tmpName = SEARCH_JOURNAL_NAME ".tmp";
+    int fd = openat(dirFd, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        LOG_ERROR("search.write_failed").field("user", mailbox.user).field("error", strerror(errno));
+        return;
+    }
+    bool ok = write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size());
+    close(fd);
+    if (!ok || renameat(dirFd, tmpName, dirFd, SEARCH_JOURNAL_NAME) != 0)
+    {
+        LOG_ERROR("search.write_failed").field("user", mailbox.user).field("error", strerror(errno));
+        unlinkat(dirFd, tmpName, 0);
+    }
+}
+
+long MailboxStore::findMessage(const Mailbox &mailbox, uint32_t id)
+{
+    auto it = std::lower_bound(mailbox.entries.begin(), mailbox.entries.end(), id,
+                               [](const MailEntry &entry, uint32_t value) { return entry.id < value; });
+    if (it == mailbox.entries.end() || it->id != id)
+    {
+        return -1;
+    }
+    return it - mailbox.entries.begin();
+}
+
+void MailboxStore::addMessage(Mailbox &mailbox, const std::string &filename, const std::string &subject, uint64_t size,
+                              const std::vector<std::string> &terms, uint32_t id, int64_t expires)
+{
+    MailEntry entry;
+    entry.id = id != 0 ? id : mailbox.nextId;
+    entry.filename = filename;
+    entry.subject = subject;
+    entry.size = size;
+    entry.mtime = std::chrono::duration_cast<std::chrono::seconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    entry.expires = expires;
+
+    // Only a replica catching up from a snapshot or replacing a message reuses a lower ID
+    bool inOrder = entry.id >= mailbox.nextId;
+    mailbox.nextId = std::max(mailbox.nextId, entry.id + 1);
+    auto position = std::lower_bound(mailbox.entries.begin(), mailbox.entries.end(), entry.id,
+                                     [](const MailEntry &existing, uint32_t value) { return existing.id < value; });
+    mailbox.entries.insert(position, entry);
+    mailbox.bytes += entry.size;
+    scheduleExpiry(mailbox, entry);
+    if (inOrder)
+    {
+        appendJournal(mailbox, addRecord(entry));
+    }
+    else
+    {
+        int dirFd = openMailbox(mailbox);
+        if (dirFd != -1)
+        {
+            writeJournal(dirFd, mailbox);
+            close(dirFd);
+        }
+        mailbox.searchLoaded = false; // Posting lists need increasing IDs, rebuilt on the next SEARCH
+    }
+
+    // A missing record only costs a read of the message on the next load of the search index
+    {
+        TraceSpan span(TracePhase::Disk);
+        if (!appendRecord(directory(mailbox) + "/" SEARCH_JOURNAL_NAME, termsRecord(entry.id, terms)))
+        {
+            LOG_ERROR("search.append_failed").field("user", mailbox.user).field("error", strerror(errno));
+        }
+    }
+    if (mailbox.searchLoaded)
+    {
+        mailbox.search.addDocument(entry.id, terms);
+    }
+    recordChange(mailbox, entry.id, true);
+    if (changeListener)
+    {
+        changeListener(mailbox, entry, true);
+    }
+}
+
+void MailboxStore::removeMessage(Mailbox &mailbox, size_t index)
+{
+    uint32_t id = mailbox.entries[index].id;
+    if (changeListener)
+    {
+        changeListener(mailbox, mailbox.entries[index], false);
+    }
+    mailbox.bytes -= mailbox.entries[index].size;
+    mailbox.entries.erase(mailbox.entries.begin() + index);
+    appendJournal(mailbox, "-" + std::to_string(id) + "\n");
+    recordChange(mailbox, id, false);
+
+    if (mailbox.searchLoaded)
+    {
+        mailbox.search.removeDocument(id);
+    }
+}
+
+void MailboxStore::recordChange(Mailbox &mailbox, uint32_t id, bool added)
+{
+    MailChange change = {++mailbox.changeSeq, id, added};
+    mailbox.changes.push_back(change);
+    if (mailbox.changes.size() > CHANGE_HISTORY)
+    {
+        mailbox.changes.pop_front();
+    }
+}
+
+void MailboxStore::setMaxAge(const std::function<int64_t(const std::string &)> &maxAge)
+{
+    MailboxStore::maxAge = maxAge;
+}
+
+// A message expires at its TTL or once it is older than the user's max age, whichever
+// comes first. Messages that never expire are not queued.
+void MailboxStore::scheduleExpiry(const Mailbox &mailbox, const MailEntry &entry)
+{
+    if (!maxAge)
+    {
+        return;
+    }
+    int64_t deadline = entry.expires;
+    int64_t age = maxAge(mailbox.user);
+    if (age > 0 && (deadline == 0 || entry.mtime + age < deadline))
+    {
+        deadline = entry.mtime + age;
+    }
+    if (deadline == 0)
+    {
+        return;
+    }
+    Expiry expiry = {deadline, mailbox.user, entry.id, 0};
+    requeueExpiry(expiry);
+}
+
+void MailboxStore::requeueExpiry(const Expiry &expiry)
+{
+    std::lock_guard<std::mutex> guard(expiryLock);
+    expiryQueue.push(expiry);
+}
+
+std::vector<Expiry> MailboxStore::takeExpired(int64_t now, size_t limit)
+{
+    std::vector<Expiry> expired;
+    std::lock_guard<std::mutex> guard(expiryLock);
+    while (expired.size() < limit && !expiryQueue.empty() && expiryQueue.top().deadline <= now)
+    {
+        expired.push_back(expiryQueue.top());
+        expiryQueue.pop();
+    }
+    return expired;
+}
+
+std::string MailboxStore::syncToken(const Mailbox &mailbox)
+{
+    return std::to_string(epoch) + ":" + std::to_string(mailbox.changeSeq);
+}
+
+bool MailboxStore::changesSince(const Mailbox &mailbox, const std::string &token, std::vector<MailChange> &changes)
+{
+    // Token format: <epoch>:<sequence>
+    size_t colon = token.find(':');
+    if (colon == std::string::npos || token.compare(0, colon, std::to_string(epoch)) != 0)
+    {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long seq = strtoull(token.c_str() + colon + 1, &end, 10);
+    if (errno != 0 || *end != '\0' || end == token.c_str() + colon + 1 || seq > mailbox.changeSeq ||
+        mailbox.changeSeq - seq > mailbox.changes.size())
+    {
+        return false;
+    }
+
+    // Sequence numbers are consecutive, so the first change after the token is found directly
+    changes.assign(mailbox.changes.end() - (mailbox.changeSeq - seq), mailbox.changes.end());
+    return true;
+}
+
+void MailboxStore::setChangeListener(const std::function<void(const Mailbox &, const MailEntry &, bool)> &listener)
+{
+    changeListener = listener;
+}
+
+// Copies waiting to be deleted after a move are not included
+std::vector<std::string> MailboxStore::users()
+{
+    std::vector<std::string> users;
+    for (unsigned shard = 0; shard < shardFds.size(); shard++)
+    {
+        for (const auto &entry : readDirectory(shardFds[shard]))
+        {
+            if (entry.second == DT_DIR && shards.locate(entry.first) == shard)
+            {
+                users.push_back(entry.first);
+            }
+        }
+    }
+    return users;
+}
+
+void MailboxStore::stop()
+{
+    stopping = true;
+    if (warmupThread.joinable())
+    {
+        warmupThread.join();
+    }
+    if (rebalanceThread.joinable())
+    {
+        rebalanceThread.join();
+    }
+}
+
+void MailboxStore::startWarmup(unsigned threadCount)
+{
+    if (threadCount == 0)
+    {
+        return; // Mailboxes are loaded on first use only
+    }
+    warmupThread = std::thread(&MailboxStore::runWarmup, this, threadCount);
+}
+
+// Loads every mailbox of the spool in parallel and reports the progress.
+// Commands for mailboxes that are not loaded yet load them on demand meanwhile.
+void MailboxStore::runWarmup(unsigned threadCount)
+{
+    auto started = std::chrono::steady_clock::now();
+    auto lastReport = started;
+
+    std::vector<std::string> users = MailboxStore::users();
+
+    std::atomic<size_t> nextUser(0);
+    std::atomic<size_t> loadedUsers(0);
+    std::atomic<size_t> loadedMessages(0);
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threadCount && i < users.size(); i++)
+    {
+        workers.push_back(std::thread([&]() {
+            size_t index;
+            while (!stopping && (index = nextUser++) < users.size())
+            {
+                std::shared_ptr<Mailbox> mailbox = get(users[index]);
+                if (mailbox)
+                {
+                    std::lock_guard<std::mutex> guard(mailbox->lock);
+                    load(*mailbox);
+                    loadedMessages += mailbox->entries.size();
+                }
+                loadedUsers++;
+            }
+        }));
+    }
+
+    // Report the progress about once a second until all workers are done
+    while (!stopping && loadedUsers < users.size())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (std::chrono::steady_clock::now() - lastReport >= std::chrono::seconds(1) && loadedUsers < users.size())
+        {
+            LOG_INFO("warmup.progress").field("mailboxes", loadedUsers.load()).field("total", users.size())
+                .field("messages", loadedMessages.load());
+            lastReport = std::chrono::steady_clock::now();
+        }
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    LOG_INFO("warmup.finished").field("mailboxes", loadedUsers.load()).field("messages", loadedMessages.load())
+        .field("ms", elapsed.count());
+}
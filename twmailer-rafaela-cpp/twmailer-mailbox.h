@@ -0,0 +1,183 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include "twmailer-search.h"
+#include "twmailer-shards.h"
+
+// One message as recorded in the mailbox index
+struct MailEntry {
+    uint32_t id;          // Stable message ID, never reused within a mailbox
+    std::string filename; // File name inside the user's directory
+    std::string subject;
+    uint64_t size;
+    int64_t mtime;        // Modification time of the message file (seconds)
+    int64_t expires = 0;  // Deletion time requested with SEND (seconds), 0 if none
+};
+
+// A message waiting in the expiry queue
+struct Expiry {
+    int64_t deadline;
+    std::string user;
+    uint32_t id;
+    unsigned attempts; // Failed deletions so far
+
+    bool operator>(const Expiry& other) const { return deadline > other.deadline; }
+};
+
+// A message added to or removed from a mailbox, reported by SYNC
+struct MailChange {
+    uint64_t seq; // Position in the mailbox's change sequence, starting at 1
+    uint32_t id;
+    bool added;
+};
+
+// Index of one user's mailbox. Callers hold `lock` while reading or changing it.
+struct Mailbox {
+    std::mutex lock;
+    std::string user;
+    unsigned shard = 0;           // Spool root holding the mailbox; only changed with `lock` held and busy == 0
+    std::atomic<unsigned> busy{0}; // Sessions using the mailbox's files without holding `lock`
+    bool loaded = false;
+    uint32_t nextId = 1;
+    size_t journalRecords = 0;      // Records in the on-disk journal, used to decide when to compact
+    std::vector<MailEntry> entries; // Ordered by ID; the position is the LIST/READ/DEL number
+    uint64_t bytes = 0;             // Sum of the entry sizes, kept current by addMessage and removeMessage
+    bool searchLoaded = false;      // The search index is read from the term journal on the first SEARCH
+    SearchIndex search;
+    uint64_t changeSeq = 0;         // Sequence number of the last change
+    std::deque<MailChange> changes; // Most recent changes, oldest first
+};
+
+// Keeps a mailbox on its shard while its files are used without holding mailbox.lock.
+// Created while holding the lock; may be destroyed without it.
+class MailboxUse {
+public:
+    explicit MailboxUse(Mailbox& mailbox) : mailbox(mailbox) { mailbox.busy++; }
+    ~MailboxUse() { mailbox.busy--; }
+
+private:
+    Mailbox& mailbox;
+};
+
+// Keeps the per-user mailbox indexes of the spool directories.
+// The index of a mailbox is persisted as an append-only journal in <root>/<user>/.index
+// and validated against the directory when the mailbox is loaded. The search terms of the
+// messages are appended to a second journal, <root>/<user>/.search, as they are stored.
+// Users are spread over the spool roots by a ShardMap; mailboxes not on their shard are
+// moved in the background.
+class MailboxStore {
+public:
+    MailboxStore();
+    ~MailboxStore();
+
+    // Opens the spool roots; the first one holds the shard manifest. Each shard gets an
+    // I/O queue with ioThreads workers.
+    bool open(const std::vector<std::string>& roots, unsigned ioThreads);
+
+    // Returns the mailbox object for a user (not necessarily loaded), nullptr for invalid names
+    std::shared_ptr<Mailbox> get(const std::string& user);
+
+    // User names become directory names and fields of the tab and space separated index,
+    // manifest and change log, so they may not contain separators or control characters
+    static bool isValidUser(const std::string& user);
+
+    // Directory of a mailbox; the caller holds mailbox.lock or a MailboxUse
+    std::string directory(const Mailbox& mailbox);
+
+    // I/O queue of the shard holding a mailbox; the caller holds mailbox.lock or a MailboxUse
+    IoQueue& io(const Mailbox& mailbox);
+
+    // Loads the index of a mailbox if needed; the caller holds mailbox.lock.
+    // Returns false if the user has no directory.
+    bool load(Mailbox& mailbox);
+
+    // Builds the search index of a loaded mailbox from its term journal if needed; the caller
+    // holds mailbox.lock
+    void loadSearch(Mailbox& mailbox);
+
+    // Returns the position of a message ID in mailbox.entries, or -1
+    long findMessage(const Mailbox& mailbox, uint32_t id);
+
+    // Records a message that was written to the user's directory together with its search
+    // terms; the caller holds mailbox.lock. A replica passes the ID the primary assigned,
+    // otherwise the next free ID is used.
+    void addMessage(Mailbox& mailbox, const std::string& filename, const std::string& subject, uint64_t size,
+                    const std::vector<std::string>& terms, uint32_t id = 0, int64_t expires = 0);
+
+    // Forgets the message at the given position; the caller holds mailbox.lock
+    void removeMessage(Mailbox& mailbox, size_t index);
+
+    // Returns the sync token describing the current state of a mailbox
+    std::string syncToken(const Mailbox& mailbox);
+
+    // Collects the changes made after the state described by token. Returns false if the
+    // token is unknown or too old and the client has to fetch the whole index instead.
+    bool changesSince(const Mailbox& mailbox, const std::string& token, std::vector<MailChange>& changes);
+
+    // Called for every message added or removed, with mailbox.lock held
+    void setChangeListener(const std::function<void(const Mailbox&, const MailEntry&, bool)>& listener);
+
+    // Sets the longest time a user's messages are kept (seconds, 0 to keep them) and enables
+    // the expiry queue; must be called before the first mailbox is loaded. Without it no
+    // deadlines are queued, as on a replica, which follows the primary's deletions.
+    void setMaxAge(const std::function<int64_t(const std::string&)>& maxAge);
+
+    // Takes up to limit messages whose deadline has passed from the expiry queue. The queue
+    // is not updated by DEL, so some of them may be gone already.
+    std::vector<Expiry> takeExpired(int64_t now, size_t limit);
+
+    // Puts a message taken from the expiry queue back, e.g. to retry a failed deletion later
+    void requeueExpiry(const Expiry& expiry);
+
+    // Users that have a mailbox directory on their shard
+    std::vector<std::string> users();
+
+    // Loads all mailboxes in the background using the given number of threads
+    void startWarmup(unsigned threadCount);
+
+    // Ends the warm-up and the rebalancing; afterwards the store only changes on request
+    void stop();
+
+private:
+    void runWarmup(unsigned threadCount);
+    std::vector<std::pair<std::string, unsigned>> scanShards();
+    void runRebalance(std::vector<std::pair<std::string, unsigned>> leftovers);
+    bool moveMailbox(Mailbox& mailbox, unsigned target);
+    int openMailbox(const Mailbox& mailbox);
+    bool readJournal(int dirFd, Mailbox& mailbox);
+    void writeJournal(int dirFd, Mailbox& mailbox);
+    void appendJournal(Mailbox& mailbox, const std::string& record);
+    bool indexFile(int dirFd, const std::string& filename, MailEntry& entry);
+    bool readTerms(int dirFd, const MailEntry& entry, std::vector<std::string>& terms);
+    void writeSearchJournal(int dirFd, Mailbox& mailbox, const std::map<uint32_t, std::vector<std::string>>& documents);
+    void recordChange(Mailbox& mailbox, uint32_t id, bool added);
+    void scheduleExpiry(const Mailbox& mailbox, const MailEntry& entry);
+
+    ShardMap shards;
+    std::vector<int> shardFds;
+    std::vector<std::unique_ptr<IoQueue>> ioQueues;
+    std::function<void(const Mailbox&, const MailEntry&, bool)> changeListener;
+    std::function<int64_t(const std::string&)> maxAge;
+    std::mutex expiryLock;
+    std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>> expiryQueue; // Earliest deadline first
+    uint64_t epoch; // Changes are kept in memory only; tokens of an earlier process are not valid
+    std::mutex mailboxesLock;
+    std::map<std::string, std::shared_ptr<Mailbox>> mailboxes;
+    std::thread warmupThread;
+    std::thread rebalanceThread;
+    std::atomic<bool> stopping;
+};
+
+#endif // MAILBOX_H
@@ -0,0 +1,652 @@
+#include "twmailer-replication.h"
+#include "twmailer-log.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define LOG_KEEP 65536        // Records kept in memory and, at least, in the file
+#define STREAM_TIMEOUT_MS 3000 // The primary pings every second; silence this long means it is gone
+#define RECONNECT_MS 1000
+#define ACK_INTERVAL 64        // Records applied between acknowledgements while more data is queued
+
+// Record line: <seq>\t<+|->\t<user>\t<id>\t<size>\t<filename>\t<subject>
+static std::string formatRecord(const ReplicationRecord &record)
+{
+    return std::to_string(record.seq) + "\t" + (record.added ? "+" : "-") + "\t" + record.user + "\t" +
+           std::to_string(record.id) + "\t" + std::to_string(record.size) + "\t" + record.filename + "\t" +
+           record.subject + "\n";
+}
+
+static bool parseRecord(const std::string &line, ReplicationRecord &record)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (fields.size() < 6)
+    {
+        size_t tab = line.find('\t', start);
+        if (tab == std::string::npos)
+        {
+            return false;
+        }
+        fields.push_back(line.substr(start, tab - start));
+        start = tab + 1;
+    }
+    record.seq = strtoull(fields[0].c_str(), nullptr, 10);
+    record.added = fields[1] == "+";
+    record.user = fields[2];
+    record.id = strtoul(fields[3].c_str(), nullptr, 10);
+    record.size = strtoull(fields[4].c_str(), nullptr, 10);
+    record.filename = fields[5];
+    record.subject = line.substr(start);
+    return record.seq != 0 && (fields[1] == "+" || fields[1] == "-");
+}
+
+ChangeLog::ChangeLog() : fd(-1), baseSeq(0), seq(0), fileRecords(0)
+{
+}
+
+ChangeLog::~ChangeLog()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+bool ChangeLog::open(const std::string &path)
+{
+    ChangeLog::path = path;
+
+    // Header: id <log id> <sequence number before the first record>
+    std::ifstream file(path);
+    std::string line;
+    bool damaged = false;
+    if (std::getline(file, line))
+    {
+        std::istringstream header(line);
+        std::string keyword;
+        header >> keyword >> logId >> baseSeq;
+        if (keyword != "id" || logId.empty())
+        {
+            std::cerr << "Invalid replication log: " << path << "\n";
+            return false;
+        }
+        seq = baseSeq;
+
+        ReplicationRecord record;
+        while (std::getline(file, line))
+        {
+            // A torn last record from a crash is dropped
+            if (!parseRecord(line, record) || record.seq != seq + 1)
+            {
+                damaged = true;
+                break;
+            }
+            seq = record.seq;
+            recent.push_back(record);
+            if (recent.size() > LOG_KEEP)
+            {
+                recent.pop_front();
+            }
+            fileRecords++;
+        }
+    }
+    else
+    {
+        std::random_device random;
+        char id[17];
+        snprintf(id, sizeof(id), "%08x%08x", random(), random());
+        logId = id;
+        damaged = true; // Writes the header
+    }
+
+    if (damaged)
+    {
+        rewrite();
+    }
+    else
+    {
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd == -1)
+    {
+        perror("Error opening replication log");
+        return false;
+    }
+    return true;
+}
+
+// Writes the kept records to a new file; the caller holds lock or is the only user
+void ChangeLog::rewrite()
+{
+    baseSeq = recent.empty() ? seq : recent.front().seq - 1;
+    std::string content = "id " + logId + " " + std::to_string(baseSeq) + "\n";
+    for (const ReplicationRecord &record : recent)
+    {
+        content += formatRecord(record);
+    }
+
+    std::string tempPath = path + ".tmp";
+    int tempFd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = tempFd != -1 && write(tempFd, content.data(), content.size()) == static_cast<ssize_t>(content.size()) &&
+              fsync(tempFd) == 0;
+    if (tempFd != -1)
+    {
+        close(tempFd);
+    }
+    if (!ok || rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        LOG_ERROR("replication.log_write_failed").field("path", path).field("error", strerror(errno));
+        unlink(tempPath.c_str());
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    fileRecords = recent.size();
+}
+
+const std::string &ChangeLog::id() const
+{
+    return logId;
+}
+
+uint64_t ChangeLog::lastSeq()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return seq;
+}
+
+uint64_t ChangeLog::append(ReplicationRecord record)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    record.seq = ++seq;
+    std::string line = formatRecord(record);
+    if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+    {
+        LOG_ERROR("replication.log_append_failed").field("path", path).field("error", strerror(errno));
+    }
+
+    recent.push_back(record);
+    if (recent.size() > LOG_KEEP)
+    {
+        recent.pop_front();
+    }
+    if (++fileRecords > 2 * LOG_KEEP)
+    {
+        rewrite();
+    }
+    appended.notify_all();
+    return record.seq;
+}
+
+bool ChangeLog::readSince(uint64_t after, std::vector<ReplicationRecord> &records, size_t limit)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t first = recent.empty() ? seq + 1 : recent.front().seq;
+    if (after > seq || after + 1 < first)
+    {
+        return false;
+    }
+    for (size_t index = after + 1 - first; index < recent.size() && records.size() < limit; index++)
+    {
+        records.push_back(recent[index]);
+    }
+    return true;
+}
+
+void ChangeLog::waitForRecords(uint64_t after, int timeoutMs)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    appended.wait_for(guard, std::chrono::milliseconds(timeoutMs), [this, after]() { return seq > after; });
+}
+
+void ChangeLog::acknowledge(int replica, uint64_t position)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    replicas[replica] = position;
+    acknowledged.notify_all();
+}
+
+void ChangeLog::removeReplica(int replica)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    replicas.erase(replica);
+    acknowledged.notify_all();
+}
+
+void ChangeLog::waitForReplicas(uint64_t position, uint64_t maxLag, int timeoutMs)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    acknowledged.wait_for(guard, std::chrono::milliseconds(timeoutMs), [this, position, maxLag]() {
+        for (const auto &replica : replicas)
+        {
+            if (replica.second + maxLag < position)
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+// Buffered reading from the primary with a timeout
+class Replica::Stream {
+public:
+    explicit Stream(TlsSocket &socket) : socket(socket), offset(0)
+    {
+    }
+
+    bool readLine(std::string &line)
+    {
+        while (true)
+        {
+            size_t end = buffer.find('\n', offset);
+            if (end != std::string::npos)
+            {
+                line.assign(buffer, offset, end - offset);
+                offset = end + 1;
+                return true;
+            }
+            if (!receive())
+            {
+                return false;
+            }
+        }
+    }
+
+    bool readBytes(size_t length, std::string &data)
+    {
+        while (buffer.size() - offset < length)
+        {
+            if (!receive())
+            {
+                return false;
+            }
+        }
+        data.assign(buffer, offset, length);
+        offset += length;
+        return true;
+    }
+
+    bool buffered() const
+    {
+        return offset < buffer.size();
+    }
+
+private:
+    bool receive()
+    {
+        if (offset > 0)
+        {
+            buffer.erase(0, offset);
+            offset = 0;
+        }
+        char chunk[65536];
+        ssize_t bytes = socket.recv(chunk, sizeof(chunk), STREAM_TIMEOUT_MS);
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        buffer.append(chunk, bytes);
+        return true;
+    }
+
+    TlsSocket &socket;
+    std::string buffer;
+    size_t offset;
+};
+
+// Parses "<keyword> <seq> <user> <id> <size>\t<filename>\t<subject>" as sent for SEND and FILE
+static bool parseMessageHeader(const std::string &line, ReplicationRecord &record)
+{
+    size_t tab = line.find('\t');
+    size_t secondTab = tab == std::string::npos ? std::string::npos : line.find('\t', tab + 1);
+    if (secondTab == std::string::npos)
+    {
+        return false;
+    }
+    std::istringstream fields(line.substr(0, tab));
+    std::string keyword;
+    if (!(fields >> keyword >> record.seq >> record.user >> record.id >> record.size))
+    {
+        return false;
+    }
+    record.filename = line.substr(tab + 1, secondTab - tab - 1);
+    record.subject = line.substr(secondTab + 1);
+    return true;
+}
+
+Replica::Replica(MailboxStore &mailboxes, const std::string &statePath)
+    : mailboxes(mailboxes), statePath(statePath), port(0), tls(nullptr), stopping(false), appliedSeq(0), primarySeq(0),
+      synced(false)
+{
+    loadState();
+}
+
+Replica::~Replica()
+{
+    stop();
+}
+
+void Replica::start(const std::string &host, int port, TlsContext *tls)
+{
+    Replica::host = host;
+    Replica::port = port;
+    Replica::tls = tls;
+    thread = std::thread(&Replica::run, this);
+}
+
+void Replica::stop()
+{
+    stopping = true;
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+bool Replica::readable(uint64_t maxLag)
+{
+    return synced && primarySeq <= appliedSeq + maxLag;
+}
+
+void Replica::loadState()
+{
+    std::ifstream state(statePath);
+    uint64_t seq = 0;
+    if (state >> logId >> seq)
+    {
+        appliedSeq = seq;
+    }
+}
+
+void Replica::saveState()
+{
+    std::string tempPath = statePath + ".tmp";
+    {
+        std::ofstream state(tempPath, std::ios::trunc);
+        state << logId << " " << appliedSeq << "\n";
+    }
+    rename(tempPath.c_str(), statePath.c_str());
+}
+
+// Connects to the primary again and again until the server stops
+void Replica::run()
+{
+    while (!stopping)
+    {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *address = nullptr;
+        int socketFd = -1;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &address) == 0)
+        {
+            socketFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (socketFd != -1 && connect(socketFd, address->ai_addr, address->ai_addrlen) != 0)
+            {
+                close(socketFd);
+                socketFd = -1;
+            }
+            freeaddrinfo(address);
+        }
+
+        if (socketFd != -1)
+        {
+            {
+                TlsSocket transport;
+                transport.attach(socketFd);
+                if (!tls || tls->connect(transport, host))
+                {
+                    follow(transport);
+                }
+            }
+            close(socketFd);
+            if (!stopping)
+            {
+                LOG_WARNING("replica.disconnected").field("primary", host + ":" + std::to_string(port));
+            }
+        }
+        synced = false;
+
+        for (int waited = 0; waited < RECONNECT_MS && !stopping; waited += 100)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+}
+
+// Runs one replication session: optional snapshot, then the change stream
+bool Replica::follow(TlsSocket &socket)
+{
+    Stream stream(socket);
+    std::string line;
+    if (!stream.readLine(line) ||
+        !socket.sendAll("REPLICATE\n" + (logId.empty() ? "-" : logId) + "\n" + std::to_string(appliedSeq) + "\n") ||
+        !stream.readLine(line))
+    {
+        return false;
+    }
+
+    // SNAPSHOT|STREAM <log id> <seq>
+    std::istringstream header(line);
+    std::string kind, id;
+    uint64_t seq = 0;
+    header >> kind >> id >> seq;
+    if (kind == "SNAPSHOT")
+    {
+        LOG_INFO("replica.snapshot_started").field("seq", seq);
+
+        // Messages the primary does not have any more are removed after the snapshot
+        std::map<std::string, std::set<uint32_t>> stale;
+        for (const std::string &user : mailboxes.users())
+        {
+            std::shared_ptr<Mailbox> mailbox = mailboxes.get(user);
+            std::lock_guard<std::mutex> guard(mailbox->lock);
+            if (mailboxes.load(*mailbox))
+            {
+                for (const MailEntry &entry : mailbox->entries)
+                {
+                    stale[user].insert(entry.id);
+                }
+            }
+        }
+
+        size_t files = 0;
+        while (true)
+        {
+            ReplicationRecord record;
+            std::string content;
+            if (!stream.readLine(line))
+            {
+                return false;
+            }
+            if (line == "END")
+            {
+                break;
+            }
+            if (!parseMessageHeader(line, record) || !stream.readBytes(record.size, content) ||
+                !applySend(record.user, record.id, record.filename, record.subject, content))
+            {
+                return false;
+            }
+            stale[record.user].erase(record.id);
+            files++;
+        }
+        for (const auto &user : stale)
+        {
+            for (uint32_t staleId : user.second)
+            {
+                applyDelete(user.first, staleId);
+            }
+        }
+        LOG_INFO("replica.snapshot_applied").field("messages", files);
+    }
+    else if (kind != "STREAM")
+    {
+        LOG_ERROR("replica.refused").field("response", line);
+        return false;
+    }
+
+    logId = id;
+    appliedSeq = seq;
+    primarySeq = std::max<uint64_t>(primarySeq, seq);
+    saveState();
+    synced = true;
+    LOG_INFO("replica.following").field("primary", host + ":" + std::to_string(port)).field("seq", seq);
+
+    size_t unacknowledged = 0;
+    while (!stopping)
+    {
+        if (!stream.readLine(line))
+        {
+            return false;
+        }
+
+        ReplicationRecord record = ReplicationRecord();
+        if (line.compare(0, 5, "SEND ") == 0)
+        {
+            std::string content;
+            if (!parseMessageHeader(line, record) || !stream.readBytes(record.size, content) ||
+                !applySend(record.user, record.id, record.filename, record.subject, content))
+            {
+                return false;
+            }
+        }
+        else if (line.compare(0, 4, "DEL ") == 0 || line.compare(0, 5, "SKIP ") == 0)
+        {
+            std::istringstream fields(line);
+            std::string keyword;
+            fields >> keyword >> record.seq >> record.user >> record.id;
+            if (keyword == "DEL")
+            {
+                applyDelete(record.user, record.id);
+            }
+        }
+        else if (line.compare(0, 5, "PING ") == 0)
+        {
+            primarySeq = std::max<uint64_t>(primarySeq, strtoull(line.c_str() + 5, nullptr, 10));
+            continue;
+        }
+        else
+        {
+            return false;
+        }
+
+        appliedSeq = record.seq;
+        primarySeq = std::max<uint64_t>(primarySeq, record.seq);
+
+        // Acknowledge once caught up with what arrived, or regularly during a long burst
+        if (++unacknowledged >= ACK_INTERVAL || !stream.buffered())
+        {
+            saveState();
+            if (!socket.sendAll("ACK " + std::to_string(appliedSeq) + "\n"))
+            {
+                return false;
+            }
+            unacknowledged = 0;
+        }
+    }
+    return true;
+}
+
+// Stores a message under the primary's file name and ID. A message already present is skipped
+// if it is the same one; a different message under the ID (the primary's spool was replaced)
+// replaces it.
+bool Replica::applySend(const std::string &user, uint32_t id, const std::string &filename, const std::string &subject,
+                        const std::string &content)
+{
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(user);
+    if (!mailbox || filename.empty() || filename[0] == '.' || filename.find('/') != std::string::npos)
+    {
+        LOG_ERROR("replica.invalid_message").field("user", user).field("filename", filename);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    std::string directory = mailboxes.directory(*mailbox);
+    if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        LOG_ERROR("replica.mkdir_failed").field("path", directory).field("error", strerror(errno));
+        return false;
+    }
+    if (!mailboxes.load(*mailbox))
+    {
+        return false;
+    }
+    long index = mailboxes.findMessage(*mailbox, id);
+    if (index != -1)
+    {
+        const MailEntry &existing = mailbox->entries[index];
+        if (existing.filename == filename && existing.size == content.size())
+        {
+            return true;
+        }
+        LOG_WARNING("replica.message_replaced").field("user", user).field("id", id)
+            .field("old_filename", existing.filename).field("filename", filename);
+        if (existing.filename != filename)
+        {
+            unlink((directory + "/" + existing.filename).c_str());
+        }
+        mailboxes.removeMessage(*mailbox, index);
+    }
+
+    // Written to a hidden file and renamed, like a SEND on the primary
+    bool written = mailboxes.io(*mailbox).run([&]() {
+        std::string tempPath = directory + "/.incoming-XXXXXX";
+        int fd = mkstemp(&tempPath[0]);
+        if (fd == -1)
+        {
+            return false;
+        }
+        bool ok = write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()) && fsync(fd) == 0;
+        close(fd);
+        if (!ok || rename(tempPath.c_str(), (directory + "/" + filename).c_str()) != 0)
+        {
+            unlink(tempPath.c_str());
+            return false;
+        }
+        return true;
+    });
+    if (!written)
+    {
+        LOG_ERROR("replica.write_failed").field("user", user).field("filename", filename).field("error", strerror(errno));
+        return false;
+    }
+    DocumentTerms terms;
+    terms.feed(content.data(), content.size());
+    mailboxes.addMessage(*mailbox, filename, subject, content.size(), terms.finish(), id);
+    return true;
+}
+
+void Replica::applyDelete(const std::string &user, uint32_t id)
+{
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(user);
+    if (!mailbox)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    long index = mailboxes.load(*mailbox) ? mailboxes.findMessage(*mailbox, id) : -1;
+    if (index == -1)
+    {
+        return;
+    }
+    unlink((mailboxes.directory(*mailbox) + "/" + mailbox->entries[index].filename).c_str());
+    mailboxes.removeMessage(*mailbox, index);
+}
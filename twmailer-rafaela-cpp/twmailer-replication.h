@@ -0,0 +1,111 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include "twmailer-mailbox.h"
+#include "twmailer-tls.h"
+
+// One SEND (added) or DEL of the change log
+struct ReplicationRecord {
+    uint64_t seq;
+    bool added;
+    std::string user;
+    uint32_t id;
+    uint64_t size;
+    std::string filename;
+    std::string subject;
+};
+
+// Sequenced log of the SENDs and DELs of a primary, persisted in <spool>/.replication-log.
+// The first line holds the log ID and the sequence number before the first record; a
+// replica whose position is not in the log any more catches up from a snapshot.
+class ChangeLog {
+public:
+    ChangeLog();
+    ~ChangeLog();
+
+    bool open(const std::string& path);
+    const std::string& id() const;
+    uint64_t lastSeq();
+
+    // Assigns the next sequence number to the record and appends it
+    uint64_t append(ReplicationRecord record);
+
+    // Copies up to limit records after seq. Returns false if seq is not covered by the log.
+    bool readSince(uint64_t seq, std::vector<ReplicationRecord>& records, size_t limit);
+
+    // Waits until there is a record after seq, at most timeoutMs
+    void waitForRecords(uint64_t seq, int timeoutMs);
+
+    // Progress of the connected replicas, used to bound their lag
+    void acknowledge(int replica, uint64_t seq);
+    void removeReplica(int replica);
+
+    // Waits until every connected replica is at most maxLag records behind seq, at most timeoutMs
+    void waitForReplicas(uint64_t seq, uint64_t maxLag, int timeoutMs);
+
+private:
+    void rewrite();
+
+    std::mutex lock;
+    std::condition_variable appended;
+    std::condition_variable acknowledged;
+    std::string path;
+    std::string logId;
+    int fd;
+    uint64_t baseSeq; // Sequence number before the first record in the file
+    uint64_t seq;
+    size_t fileRecords;
+    std::deque<ReplicationRecord> recent;
+    std::map<int, uint64_t> replicas;
+};
+
+// Follows a primary: streams its change log and applies it to the local spool.
+// The position in the primary's log is kept in <spool>/.replica-state.
+class Replica {
+public:
+    Replica(MailboxStore& mailboxes, const std::string& statePath);
+    ~Replica();
+
+    // With a TLS context the primary's certificate is verified for host
+    void start(const std::string& host, int port, TlsContext* tls = nullptr);
+    void stop();
+
+    // True if the replica is in sync with the primary up to maxLag records
+    bool readable(uint64_t maxLag);
+
+private:
+    class Stream;
+
+    void run();
+    bool follow(TlsSocket& socket);
+    bool applySend(const std::string& user, uint32_t id, const std::string& filename, const std::string& subject,
+                   const std::string& content);
+    void applyDelete(const std::string& user, uint32_t id);
+    void loadState();
+    void saveState();
+
+    MailboxStore& mailboxes;
+    std::string statePath;
+    std::string host;
+    int port;
+    TlsContext* tls;
+    std::thread thread;
+    std::atomic<bool> stopping;
+
+    std::string logId;
+    std::atomic<uint64_t> appliedSeq;
+    std::atomic<uint64_t> primarySeq;
+    std::atomic<bool> synced; // Connected and not in the middle of a snapshot
+};
+
+#endif // REPLICATION_H
@@ -0,0 +1,149 @@
+#include "twmailer-scanner.h"
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCANNER_X86 1
+#endif
+
+// Handles a '\n' or '\\' found at position i; lineStart is where the current line began
+static inline void handleSpecial(const char *data, size_t length, size_t i, std::vector<Span> &lines, size_t &lineStart)
+{
+    if (data[i] == '\n')
+    {
+        Span span = {lineStart, i - lineStart};
+        lines.push_back(span);
+        lineStart = i + 1;
+    }
+    else if (i + 1 < length && data[i + 1] == 'n')
+    {
+        // Backslash followed by 'n' ends the line as well
+        Span span = {lineStart, i - lineStart};
+        lines.push_back(span);
+        lineStart = i + 2;
+    }
+}
+
+static size_t scanScalar(const char *data, size_t length, std::vector<Span> &lines)
+{
+    size_t lineStart = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (data[i] == '\n' || data[i] == '\\')
+        {
+            handleSpecial(data, length, i, lines, lineStart);
+        }
+    }
+    return lineStart;
+}
+
+#ifdef SCANNER_X86
+// Compares 16 bytes at a time and visits only the positions of special characters
+__attribute__((target("sse2"))) static size_t scanSse2(const char *data, size_t length, std::vector<Span> &lines)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t lineStart = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, newline), _mm_cmpeq_epi8(block, backslash)));
+        while (mask != 0)
+        {
+            handleSpecial(data, length, i + __builtin_ctz(mask), lines, lineStart);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < length; i++)
+    {
+        if (data[i] == '\n' || data[i] == '\\')
+        {
+            handleSpecial(data, length, i, lines, lineStart);
+        }
+    }
+    return lineStart;
+}
+
+// Same as scanSse2 with 32 byte blocks
+__attribute__((target("avx2"))) static size_t scanAvx2(const char *data, size_t length, std::vector<Span> &lines)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t lineStart = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, newline), _mm256_cmpeq_epi8(block, backslash)));
+        while (mask != 0)
+        {
+            handleSpecial(data, length, i + __builtin_ctz(mask), lines, lineStart);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < length; i++)
+    {
+        if (data[i] == '\n' || data[i] == '\\')
+        {
+            handleSpecial(data, length, i, lines, lineStart);
+        }
+    }
+    return lineStart;
+}
+#endif
+
+typedef size_t (*ScanFunction)(const char *, size_t, std::vector<Span> &);
+
+struct ScannerChoice {
+    ScanFunction scan;
+    const char *name;
+};
+
+// Picks the widest implementation the CPU supports; TWMAILER_SCANNER=scalar|sse2 forces a narrower one
+static ScannerChoice selectScanner()
+{
+    ScannerChoice choice = {scanScalar, "scalar"};
+#ifdef SCANNER_X86
+    const char *forced = getenv("TWMAILER_SCANNER");
+    std::string limit = forced != nullptr ? forced : "avx2";
+    __builtin_cpu_init();
+    if (limit != "scalar" && __builtin_cpu_supports("sse2"))
+    {
+        choice.scan = scanSse2;
+        choice.name = "sse2";
+    }
+    if (limit == "avx2" && __builtin_cpu_supports("avx2"))
+    {
+        choice.scan = scanAvx2;
+        choice.name = "avx2";
+    }
+#endif
+    return choice;
+}
+
+static const ScannerChoice &scanner()
+{
+    static const ScannerChoice choice = selectScanner();
+    return choice;
+}
+
+size_t scanLines(const char *data, size_t length, std::vector<Span> &lines)
+{
+    return scanner().scan(data, length, lines);
+}
+
+const char *scannerImplementation()
+{
+    return scanner().name;
+}
+
+// glibc's memchr already picks a vectorized implementation at runtime
+size_t findLineEnd(const char *data, size_t length)
+{
+    const void *position = memchr(data, '\n', length);
+    return position != nullptr ? static_cast<const char *>(position) - data : length;
+}
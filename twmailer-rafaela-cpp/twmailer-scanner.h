@@ -0,0 +1,27 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// A line inside a receive buffer, without its line break
+struct Span {
+    size_t offset;
+    size_t length;
+};
+
+// Splits a buffer into lines in a single pass. A line ends at '\n' or at the
+// escape sequence "\n" (backslash, 'n') that terminal clients send instead.
+// Complete lines are appended to `lines`; the return value is the number of bytes
+// they cover, so everything after it is an unfinished line.
+// Uses AVX2 or SSE2 when the CPU supports them, otherwise a scalar loop.
+size_t scanLines(const char* data, size_t length, std::vector<Span>& lines);
+
+// Returns the position of the first '\n' in the buffer, or `length` if there is none
+size_t findLineEnd(const char* data, size_t length);
+
+// Name of the scanner implementation selected for this CPU
+const char* scannerImplementation();
+
+#endif // SCANNER_H
@@ -0,0 +1,327 @@
+#include "twmailer-search.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+
+#define MAX_TERM_LENGTH 64 // Longer words are not indexed
+
+// Letters, digits and UTF-8 sequences form words
+static bool isWordCharacter(unsigned char c)
+{
+    return isalnum(c) || c >= 0x80;
+}
+
+// Splits text into lowercase words
+static std::vector<std::string> tokenize(const char *text, size_t length)
+{
+    std::vector<std::string> words;
+    std::string word;
+    for (size_t i = 0; i <= length; i++)
+    {
+        unsigned char c = i < length ? text[i] : ' ';
+        if (isWordCharacter(c))
+        {
+            word += static_cast<char>(tolower(c));
+            continue;
+        }
+        if (!word.empty() && word.length() <= MAX_TERM_LENGTH)
+        {
+            words.push_back(word);
+        }
+        word.clear();
+    }
+    return words;
+}
+
+static void appendVarint(std::vector<uint8_t> &bytes, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        bytes.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+DocumentTerms::DocumentTerms() : inBody(false)
+{
+}
+
+// Header lines come first; everything after "Message: " is the body
+void DocumentTerms::feed(const char *data, size_t length)
+{
+    static const std::string messagePrefix = "Message: ";
+
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = data[i];
+        if (inBody)
+        {
+            if (isWordCharacter(c))
+            {
+                if (word.length() <= MAX_TERM_LENGTH)
+                {
+                    word += static_cast<char>(tolower(c));
+                }
+            }
+            else
+            {
+                addBodyWord();
+            }
+        }
+        else if (c == '\n')
+        {
+            addHeaderLine();
+        }
+        else
+        {
+            headerLine += static_cast<char>(c);
+            if (headerLine == messagePrefix)
+            {
+                inBody = true;
+                headerLine.clear();
+            }
+        }
+    }
+}
+
+std::vector<std::string> DocumentTerms::finish()
+{
+    if (inBody)
+    {
+        addBodyWord();
+    }
+    else
+    {
+        addHeaderLine();
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    std::vector<std::string> result;
+    result.swap(terms);
+    inBody = false;
+    return result;
+}
+
+void DocumentTerms::addHeaderLine()
+{
+    static const std::string senderPrefix = "Sender: ";
+    static const std::string subjectPrefix = "Subject: ";
+
+    if (headerLine.compare(0, senderPrefix.length(), senderPrefix) == 0)
+    {
+        addWords('f', headerLine.data() + senderPrefix.length(), headerLine.length() - senderPrefix.length());
+    }
+    else if (headerLine.compare(0, subjectPrefix.length(), subjectPrefix) == 0)
+    {
+        addWords('s', headerLine.data() + subjectPrefix.length(), headerLine.length() - subjectPrefix.length());
+    }
+    headerLine.clear();
+}
+
+void DocumentTerms::addBodyWord()
+{
+    if (!word.empty() && word.length() <= MAX_TERM_LENGTH)
+    {
+        terms.push_back("b:" + word);
+    }
+    word.clear();
+}
+
+void DocumentTerms::addWords(char field, const char *text, size_t length)
+{
+    std::string prefix(1, field);
+    prefix += ':';
+    for (const std::string &word : tokenize(text, length))
+    {
+        terms.push_back(prefix + word);
+    }
+}
+
+SearchIndex::SearchIndex() : documents(0)
+{
+}
+
+void SearchIndex::clear()
+{
+    postings.clear();
+    deleted.clear();
+    documents = 0;
+}
+
+void SearchIndex::addDocument(uint32_t id, const std::vector<std::string> &terms)
+{
+    for (const std::string &term : terms)
+    {
+        addTerm(term, id);
+    }
+    documents++;
+}
+
+// IDs arrive in increasing order, so adding is an append of the delta
+void SearchIndex::addTerm(const std::string &term, uint32_t id)
+{
+    PostingList &list = postings[term];
+    if (list.lastId == id)
+    {
+        return; // Word repeated within the same message
+    }
+    appendVarint(list.bytes, id - list.lastId);
+    list.lastId = id;
+}
+
+void SearchIndex::removeDocument(uint32_t id)
+{
+    deleted.insert(id);
+    if (documents > 0)
+    {
+        documents--;
+    }
+
+    // Drop deleted IDs from the posting lists once they make up a noticeable share
+    if (deleted.size() > documents / 4 + 64)
+    {
+        compact();
+    }
+}
+
+void SearchIndex::decode(const PostingList &list, std::vector<uint32_t> &ids) const
+{
+    uint32_t id = 0;
+    uint32_t delta = 0;
+    int shift = 0;
+    for (uint8_t byte : list.bytes)
+    {
+        delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (byte & 0x80)
+        {
+            shift += 7;
+            continue;
+        }
+        id += delta;
+        if (deleted.empty() || deleted.count(id) == 0)
+        {
+            ids.push_back(id);
+        }
+        delta = 0;
+        shift = 0;
+    }
+}
+
+void SearchIndex::compact()
+{
+    for (auto it = postings.begin(); it != postings.end();)
+    {
+        std::vector<uint32_t> ids;
+        decode(it->second, ids);
+        if (ids.empty())
+        {
+            it = postings.erase(it);
+            continue;
+        }
+
+        PostingList list;
+        for (uint32_t id : ids)
+        {
+            appendVarint(list.bytes, id - list.lastId);
+            list.lastId = id;
+        }
+        list.bytes.shrink_to_fit();
+        it->second = list;
+        ++it;
+    }
+    deleted.clear();
+}
+
+// Returns the IDs containing the word in the given field, or in any field for field 0
+std::vector<uint32_t> SearchIndex::lookup(char field, const std::string &word) const
+{
+    static const char fields[] = {'f', 's', 'b'};
+    std::vector<uint32_t> ids;
+    for (char candidate : fields)
+    {
+        if (field != 0 && field != candidate)
+        {
+            continue;
+        }
+        auto it = postings.find(std::string(1, candidate) + ":" + word);
+        if (it != postings.end())
+        {
+            decode(it->second, ids);
+        }
+    }
+    if (field == 0)
+    {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+    return ids;
+}
+
+std::vector<uint32_t> SearchIndex::query(const std::string &query) const
+{
+    // Collect (field, word) clauses; all of them have to match
+    std::vector<std::pair<char, std::string>> clauses;
+    size_t start = 0;
+    while (start < query.length())
+    {
+        size_t end = query.find_first_of(" \t", start);
+        if (end == std::string::npos)
+        {
+            end = query.length();
+        }
+        std::string token = query.substr(start, end - start);
+        start = end + 1;
+
+        char field = 0;
+        size_t colon = token.find(':');
+        if (colon != std::string::npos)
+        {
+            std::string name = token.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "from")
+            {
+                field = 'f';
+            }
+            else if (name == "subject")
+            {
+                field = 's';
+            }
+            else if (name == "body")
+            {
+                field = 'b';
+            }
+            if (field != 0)
+            {
+                token.erase(0, colon + 1);
+            }
+        }
+        for (const std::string &word : tokenize(token.data(), token.length()))
+        {
+            clauses.push_back(std::make_pair(field, word));
+        }
+    }
+
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < clauses.size(); i++)
+    {
+        std::vector<uint32_t> ids = lookup(clauses[i].first, clauses[i].second);
+        if (i == 0)
+        {
+            result.swap(ids);
+        }
+        else
+        {
+            std::vector<uint32_t> both;
+            std::set_intersection(result.begin(), result.end(), ids.begin(), ids.end(), std::back_inserter(both));
+            result.swap(both);
+        }
+        if (result.empty())
+        {
+            break;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,69 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+// Splits a message in the stored format (Sender/Receiver/Subject/Message headers) into the
+// terms it is indexed under: "f:" sender, "s:" subject or "b:" body followed by a lowercase
+// word. The message may be fed in pieces as it is received or read.
+class DocumentTerms {
+public:
+    DocumentTerms();
+
+    void feed(const char* data, size_t length);
+
+    // Returns the terms, sorted and without duplicates
+    std::vector<std::string> finish();
+
+private:
+    void addHeaderLine();
+    void addBodyWord();
+    void addWords(char field, const char* text, size_t length);
+
+    bool inBody;
+    std::string headerLine;
+    std::string word;
+    std::vector<std::string> terms;
+};
+
+// Inverted index over the messages of one mailbox.
+// Terms are stored per field ("f:" sender, "s:" subject, "b:" body) and map to
+// posting lists of message IDs, delta- and varint-encoded. IDs are only ever
+// appended in increasing order; deleted IDs are filtered until the next compaction.
+class SearchIndex {
+public:
+    SearchIndex();
+
+    // Indexes a message under the terms collected by DocumentTerms
+    void addDocument(uint32_t id, const std::vector<std::string>& terms);
+
+    void removeDocument(uint32_t id);
+
+    // Returns the IDs of messages matching all terms of the query, in increasing order.
+    // Terms are words, optionally prefixed with from:, subject: or body:
+    std::vector<uint32_t> query(const std::string& query) const;
+
+    void clear();
+
+private:
+    struct PostingList {
+        std::vector<uint8_t> bytes;
+        uint32_t lastId = 0;
+    };
+
+    void addTerm(const std::string& term, uint32_t id);
+    void decode(const PostingList& list, std::vector<uint32_t>& ids) const;
+    std::vector<uint32_t> lookup(char field, const std::string& word) const;
+    void compact();
+
+    std::unordered_map<std::string, PostingList> postings;
+    std::unordered_set<uint32_t> deleted;
+    size_t documents;
+};
+
+#endif // SEARCH_H
@@ -1,13 +1,43 @@
 #include "twmailer-server.h"
+#include <climits>
 
 #define BUF 1024       // Buffer size for receiving commands
-#define BACKLOG_SIZE 5 // Number of pending connections in the queue
+#define BACKLOG_SIZE SOMAXCONN // Pending connections queued by the kernel, also while a hot upgrade waits
+#define DRAIN_POLL_MS 250 // How often idle loops re-check for a shutdown request
+#define CONNECTION_BUFFER 65536 // Receive buffer per connection; longer body lines are streamed in pieces
+#define WRITE_BUFFER 65536      // Message bytes collected before they are written to disk
+#define REPLICATION_BATCH 256   // Change log records sent to a replica at a time
+#define REPLICA_PING_MS 1000    // Idle replicas get the current sequence number this often
+#define REPLICA_WAIT_MS 1000    // Longest a SEND or DEL waits for lagging replicas
+#define SWEEP_INTERVAL_MS 100   // The retention sweeper deletes a batch of expired messages this often
+#define SWEEP_RETRY_MAX_S 3600  // Longest wait before a failed deletion is tried again; the wait doubles from 1s
+
+// Set from the signal handler once SIGTERM or SIGINT was received. Session threads read it
+// too, so it is a lock-free atomic rather than a volatile sig_atomic_t.
+static std::atomic<bool> shutdownRequested(false);
+
+static void handleShutdownSignal(int)
+{
+    shutdownRequested = true;
+}
 
 // Constructor: Initializes the server with the given port and mail spool directory
-Server::Server(int port, std::string mailSpoolDir)
+Server::Server(int port, std::string mailSpoolDir, const ServerOptions &options)
 {
     Server::port = port;
     Server::mailSpoolDir = mailSpoolDir;
+    Server::options = options;
+    upgradeSocket = -1;
+    handOffPeer = -1;
+    handedOff = false;
+    installSignalHandlers();
+
+    // The old process keeps writing to the spool until its sessions have ended, so the
+    // spool is only opened once it has handed over completely
+    if (options.takeover)
+    {
+        serverSocket = takeOverListeningSocket(); // Inherit the socket of the running server
+    }
 
     if (!createDirectory(mailSpoolDir))
     {
@@ -15,15 +45,171 @@ Server::Server(int port, std::string mailSpoolDir)
         exit(EXIT_FAILURE);
     }
 
-    serverSocket = createServerSocket(); // Creates the Server-Socket
-    bindServerSocket();                  //
-    listenForConnections();
+    // Additional spool roots, usually on other disks, become shards next to the first one
+    std::vector<std::string> roots(1, mailSpoolDir);
+    for (const std::string &root : options.shards)
+    {
+        if (!createDirectory(root))
+        {
+            std::cerr << "Error. Shard directory was not created:" << root << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        roots.push_back(root);
+    }
+
+    if (!mailboxes.open(roots, options.ioThreads))
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (!options.quotaFile.empty() && !loadQuotas())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Deadlines are computed when a mailbox is loaded, so the policy is known before the warm-up.
+    // A replica queues none: it receives the deletions of the primary's sweeper through the change log.
+    if (!options.retentionFile.empty() && !loadRetention())
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (options.replicaOf.empty())
+    {
+        mailboxes.setMaxAge([this](const std::string &user) {
+            auto it = userMaxAges.find(user);
+            return it != userMaxAges.end() ? it->second : Server::options.maxAge;
+        });
+    }
+
+    // With a certificate every client connection starts with a TLS handshake
+    if (!options.tlsCert.empty())
+    {
+        tls.reset(new TlsContext());
+        if (!tls->initServer(options.tlsCert, options.tlsKey))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.replicaTls && !options.replicaOf.empty())
+    {
+        replicaTls.reset(new TlsContext());
+        if (!replicaTls->initClient(options.tlsCa))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Every SEND and DEL of a primary is appended to the change log under the mailbox lock,
+    // so the log has the changes of each mailbox in the order they were made
+    if (options.primary)
+    {
+        changeLog.reset(new ChangeLog());
+        if (!changeLog->open(mailSpoolDir + "/.replication-log"))
+        {
+            exit(EXIT_FAILURE);
+        }
+        ChangeLog *log = changeLog.get();
+        mailboxes.setChangeListener([log](const Mailbox &mailbox, const MailEntry &entry, bool added) {
+            ReplicationRecord record = {0, added, mailbox.user, entry.id, entry.size, entry.filename, entry.subject};
+            log->append(record);
+        });
+    }
+    else if (!options.replicaOf.empty())
+    {
+        size_t colon = options.replicaOf.rfind(':');
+        char *end = nullptr;
+        long primaryPort = colon == std::string::npos ? 0 : strtol(options.replicaOf.c_str() + colon + 1, &end, 10);
+        if (primaryPort <= 0 || primaryPort > 65535 || *end != '\0')
+        {
+            std::cerr << "Error. --replica-of expects <host>:<port>" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        replica.reset(new Replica(mailboxes, mailSpoolDir + "/.replica-state"));
+        replica->start(options.replicaOf.substr(0, colon), primaryPort, replicaTls.get());
+    }
+
+    if (!options.takeover)
+    {
+        serverSocket = createServerSocket(); // Creates the Server-Socket
+        bindServerSocket();                  //
+        listenForConnections();
+    }
+
+    if (!options.upgradeSocketPath.empty())
+    {
+        upgradeSocket = createUpgradeSocket();
+    }
+
+    // Clients are served right away; mailboxes not warmed up yet are loaded on first use
+    mailboxes.startWarmup(options.warmupThreads);
+
+    // A replica receives the deletions of the primary's sweeper through the change log
+    if (!replica)
+    {
+        sweeperThread = std::thread(&Server::runSweeper, this);
+    }
 }
 
 // Destructor: Close the server socket when the server object is destroyed
 Server::~Server()
 {
-    close(serverSocket);
+    stopSweeper = true;
+    if (sweeperThread.joinable())
+    {
+        sweeperThread.join();
+    }
+    if (replica)
+    {
+        replica->stop();
+    }
+    mailboxes.stop();
+    if (handOffPeer != -1)
+    {
+        close(handOffPeer); // The new process starts using the spool now
+    }
+    if (serverSocket != -1)
+    {
+        close(serverSocket);
+    }
+    if (upgradeSocket != -1)
+    {
+        close(upgradeSocket);
+        unlink(options.upgradeSocketPath.c_str());
+    }
+}
+
+// SIGTERM/SIGINT start a graceful shutdown instead of killing the process
+void Server::installSignalHandlers()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleShutdownSignal;
+    sigemptyset(&action.sa_mask);
+    // No SA_RESTART: blocking calls return EINTR so the loops notice the request
+    if (sigaction(SIGTERM, &action, NULL) == -1 || sigaction(SIGINT, &action, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // A client vanishing mid-response must not terminate the server
+    signal(SIGPIPE, SIG_IGN);
+}
+
+// After a hand-off the sessions end like at a shutdown, so the new process can take over the spool
+bool Server::isShuttingDown()
+{
+    return shutdownRequested || handedOff;
+}
+
+static int64_t steadyMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// True once sessions that are still busy should give up their command
+bool Server::drainExpired()
+{
+    return isShuttingDown() && steadyMilliseconds() >= drainDeadline;
 }
 
 // Creates a server socket and returns its descriptor
@@ -46,6 +232,10 @@ void Server::bindServerSocket()
     serverAddress.sin_port = htons(port);
     serverAddress.sin_addr.s_addr = INADDR_ANY;
 
+    // Allow an immediate restart while old connections are still in TIME_WAIT
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     if (bind(serverSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == -1)
     {
         perror("Error binding socket");
@@ -65,395 +255,1537 @@ void Server::listenForConnections()
     }
 }
 
-// Main loop to accept and handle client connections
+// Main loop to accept and handle client connections until shutdown or hand-off
 void Server::startListening()
 {
-    std::cout << "Listening on port " << port << ":\n";
-    while (true)
-    {
-        std::cout << "Waiting for client connection...\n";
-        int clientSocket = acceptClientConnection(); // Accept a client connection
-        handleClientConnection(clientSocket);        // Handle the client connection
-    }
-}
-
-// Accepts a client connection and returns its socket descriptor
-int Server::acceptClientConnection()
-{
-    int clientSocket = accept(serverSocket, NULL, NULL);
-    if (clientSocket == -1)
+    LOG_INFO("server.listening").field("port", port).field("tls", tls ? "yes" : "no").field("scanner", scannerImplementation());
+    while (!isShuttingDown())
     {
-        perror("Error accepting connection");
-        close(serverSocket);
-        exit(EXIT_FAILURE);
-    }
-    return clientSocket;
-}
-
-// Handles the communication with a connected client
-void Server::handleClientConnection(int clientSocket)
-{
-    std::cout << "Client connected.\n";
+        struct pollfd fds[2];
+        nfds_t count = 0;
+        fds[count].fd = serverSocket;
+        fds[count++].events = POLLIN;
+        if (upgradeSocket != -1)
+        {
+            fds[count].fd = upgradeSocket;
+            fds[count++].events = POLLIN;
+        }
 
-    if (!sendWelcomeMessage(clientSocket))
-    {
-        return;
-    }
+        // Sessions run on their own threads, so the signal may not interrupt this poll
+        if (poll(fds, count, DRAIN_POLL_MS) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue; // Signal received, re-check the shutdown flag
+            }
+            LOG_ERROR("server.poll_failed").field("error", strerror(errno));
+            break;
+        }
 
-    while (true)
-    {
-        std::string command = receiveCommand(clientSocket); // Receive a command from the client
-        if (command.empty())
+        // A new server process asks for the listening socket
+        if (count > 1 && (fds[1].revents & POLLIN))
         {
-            break; // Break the loop if no command is received or on error
+            if (handOffListeningSocket())
+            {
+                break;
+            }
+            continue;
         }
 
-        if (!processCommand(clientSocket, command))
+        if (fds[0].revents & POLLIN)
         {
-            break; // Break the loop if processing results in disconnection
+            int clientSocket = acceptClientConnection(); // Accept a client connection
+            if (clientSocket != -1)
+            {
+                // Each client is served on its own thread
+                {
+                    std::lock_guard<std::mutex> guard(sessionLock);
+                    activeSessions++;
+                    sessionSockets.insert(clientSocket);
+                }
+                std::thread(&Server::runSession, this, clientSocket).detach();
+            }
         }
     }
 
-    closeClientConnection(clientSocket); // Close the client connection
-}
+    drainSessions();
 
-// Sends a welcome message to the connected client
-bool Server::sendWelcomeMessage(int clientSocket)
-{
-    const char *welcomeMessage = "Please choose your command. SEND, LIST, READ, DEL, QUIT";
-    if (send(clientSocket, welcomeMessage, strlen(welcomeMessage), 0) == -1)
+    if (handedOff)
     {
-        perror("Send error");
-        return false;
+        LOG_INFO("server.handed_off");
+    }
+    else
+    {
+        LOG_INFO("server.stopped");
+    }
+    if (tls)
+    {
+        LOG_INFO("tls.statistics").field("summary", tls->statistics());
     }
-    return true;
 }
 
-// Receives a command from the client and returns it as a string
-std::string Server::receiveCommand(int clientSocket)
+void Server::serveConnection(int clientSocket)
 {
-    char buffer[BUF];
-    memset(buffer, 0, BUF); // Clear the buffer
-
-    ssize_t bytesReceived = recv(clientSocket, buffer, BUF - 1, 0);
-    if (bytesReceived <= 0)
     {
-        handleReceiveError(bytesReceived);
-        return "";
+        std::lock_guard<std::mutex> guard(sessionLock);
+        activeSessions++;
+        sessionSockets.insert(clientSocket);
     }
-
-    buffer[bytesReceived] = '\0'; // Null-terminate the received string
-    std::string command(buffer);
-    replaceBackslashNWithNewline(command); // Convert \n sequences to actual newlines
-    return command;
+    runSession(clientSocket);
 }
 
-// Handles errors that occur during the receive operation
-void Server::handleReceiveError(ssize_t bytesReceived)
+// Sessions still open finish the command they are in; idle ones notice the shutdown within
+// DRAIN_POLL_MS. Sessions still running after --drain-timeout have their sockets shut down,
+// which also ends sends to clients that stopped reading.
+void Server::drainSessions()
 {
-    if (bytesReceived == 0)
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.drainTimeout);
+    drainDeadline = std::chrono::duration_cast<std::chrono::milliseconds>(deadline.time_since_epoch()).count();
+
+    std::unique_lock<std::mutex> guard(sessionLock);
+    if (activeSessions > 0)
     {
-        std::cout << "Client disconnected.\n";
+        LOG_INFO("server.draining").field("sessions", activeSessions).field("timeout_s", options.drainTimeout);
     }
-    else
+    if (!sessionsDone.wait_until(guard, deadline, [this]() { return activeSessions == 0; }))
     {
-        perror("Receive error");
+        LOG_WARNING("server.drain_timeout").field("sessions", activeSessions);
+        for (int clientSocket : sessionSockets)
+        {
+            shutdown(clientSocket, SHUT_RDWR);
+        }
+        sessionsDone.wait(guard, [this]() { return activeSessions == 0; });
     }
 }
 
-// Replaces the literal "\\n" sequences in a string with actual newline characters
-void Server::replaceBackslashNWithNewline(std::string &str)
+// Accepts a client connection and returns its socket descriptor, or -1 on a transient error
+int Server::acceptClientConnection()
 {
-    size_t index = 0;
-    while (true)
+    int clientSocket = accept(serverSocket, NULL, NULL);
+    if (clientSocket == -1 && errno != EINTR)
     {
-        index = str.find("\\n", index);
-        if (index == std::string::npos)
-            break;
-        str.replace(index, 2, "\n");
-        index += 1;
+        LOG_ERROR("server.accept_failed").field("error", strerror(errno));
     }
+    return clientSocket;
 }
 
-// Processes a received command and performs the corresponding action
-bool Server::processCommand(int clientSocket, const std::string &command)
+// Creates the UNIX socket on which a new server process can request the listening socket
+int Server::createUpgradeSocket()
 {
-    std::istringstream iss(command);
-    std::string commandName;
-    std::getline(iss, commandName);
-
-    if (commandName == "SEND")
-    {
-        std::cout << "SEND command received.\n";
-        processSendCommand(clientSocket, command);
-    }
-    else if (commandName == "LIST")
-    {
-        std::cout << "LIST command received.\n";
-        processListCommand(clientSocket, command);
-    }
-    else if (commandName == "READ")
-    {
-        std::cout << "READ command received.\n";
-        processReadCommand(clientSocket, command);
-    }
-    else if (commandName == "DEL")
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (options.upgradeSocketPath.length() >= sizeof(address.sun_path))
     {
-        std::cout << "DEL command received.\n";
-        processDelCommand(clientSocket, command);
+        std::cerr << "Upgrade socket path too long: " << options.upgradeSocketPath << "\n";
+        exit(EXIT_FAILURE);
     }
-    else if (commandName == "QUIT")
+    strcpy(address.sun_path, options.upgradeSocketPath.c_str());
+
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unixSocket == -1)
     {
-        std::cout << "QUIT command received. Ending connection.\n";
-        return false;
+        perror("Error creating upgrade socket");
+        exit(EXIT_FAILURE);
     }
-    else
+
+    unlink(address.sun_path); // Remove a stale socket left behind by a crashed server
+    if (bind(unixSocket, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(unixSocket, 1) == -1)
     {
-        std::cout << "Unknown command received: " << commandName << "\n";
+        perror("Error binding upgrade socket");
+        close(unixSocket);
+        exit(EXIT_FAILURE);
     }
-    return true;
+
+    // Only the owner may take over the listening socket
+    chmod(address.sun_path, 0600);
+    return unixSocket;
 }
 
-bool Server::processSendCommand(int clientSocket, const std::string &command)
+// Connects to the running server and receives its listening socket
+int Server::takeOverListeningSocket()
 {
-    // Parsing the command into components using a string stream
-    std::istringstream iss(command);
-    std::string line, sender, receiver, subject, text;
-
-    // Skip the first line which is the command name "SEND"
-    std::getline(iss, line);
+    if (options.upgradeSocketPath.empty())
+    {
+        std::cerr << "--takeover requires --upgrade-socket <path>\n";
+        exit(EXIT_FAILURE);
+    }
 
-    // Extract sender, receiver, and subject from the following lines
-    std::getline(iss, sender);
-    std::getline(iss, receiver);
-    std::getline(iss, subject);
-    std::getline(iss, text);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, options.upgradeSocketPath.c_str(), sizeof(address.sun_path) - 1);
 
-    // Compose the message body until a single dot line is encountered
-    message = "Sender: " + sender + "\nReceiver: " + receiver + "\nSubject: " + subject + "\nMessage: " + text + "\n\n";
-    while (std::getline(iss, line) && line != ".")
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unixSocket == -1 || connect(unixSocket, (struct sockaddr *)&address, sizeof(address)) == -1)
     {
-        message += line + "\n";
+        perror("Error connecting to upgrade socket");
+        exit(EXIT_FAILURE);
     }
 
-    // If there is content after the final dot, it indicates an invalid message format
-    if (std::getline(iss, line) && !line.empty())
+    int listeningSocket = receiveFileDescriptor(unixSocket);
+    if (listeningSocket == -1)
     {
-        send(clientSocket, "ERR Invalid message format\n", 27, 0);
-        return false;
+        std::cerr << "Running server did not hand off its listening socket\n";
+        close(unixSocket);
+        exit(EXIT_FAILURE);
     }
 
-    std::string receiverDir = mailSpoolDir + "/" + receiver;
-
-    if (receiver.empty())
+    // The old server closes the connection once its sessions have ended and it stopped
+    // writing to the spool; new connections wait in the listen backlog until then
+    LOG_INFO("upgrade.waiting_for_drain");
+    char byte;
+    ssize_t received;
+    while ((received = recv(unixSocket, &byte, 1, 0)) > 0 || (received == -1 && errno == EINTR))
     {
-        std::cout << "Invalid receiver name\n";
-        send(clientSocket, "ERR\n", 4, 0);
-        return false;
     }
+    close(unixSocket);
 
-    // Does the Directory already exists?
-    if (!directoryExists(receiverDir))
+    // Report the port the inherited socket is actually bound to
+    struct sockaddr_in boundAddress;
+    socklen_t length = sizeof(boundAddress);
+    if (getsockname(listeningSocket, (struct sockaddr *)&boundAddress, &length) == 0)
     {
-        std::cout << "Directory does not exist. Creating: " << receiverDir << std::endl;
-
-        // Tries to create the Directory
-        if (!createDirectory(receiverDir))
-        {
-            std::cout << "Failed to create directory: " << receiverDir << std::endl;
-            send(clientSocket, "ERR\n", 4, 0);
-            return false;
-        }
+        port = ntohs(boundAddress.sin_port);
     }
 
-    std::string filename = generateMessageFilename(receiverDir, sender, receiver);
-    saveMessage(filename, message);
-
-    send(clientSocket, "OK\n", 3, 0);
-    return true;
+    LOG_INFO("upgrade.took_over").field("port", port);
+    return listeningSocket;
 }
 
-bool Server::createDirectory(const std::string &path)
+// Passes the listening socket to the connecting process; the kernel keeps accepting in the meantime
+bool Server::handOffListeningSocket()
 {
-    struct stat st = {};
-    if (path.empty())
+    int peer = accept(upgradeSocket, NULL, NULL);
+    if (peer == -1)
     {
-        std::cerr << "Empty path provided to createDirectory function." << std::endl;
+        LOG_ERROR("upgrade.accept_failed").field("error", strerror(errno));
         return false;
     }
 
-    // Check if the directory already exists
-    if (stat(path.c_str(), &st) != 0 || !(st.st_mode & S_IFDIR))
+    bool sent = sendFileDescriptor(peer, serverSocket);
+    if (sent)
     {
-        // Attempt to create the directory
-        if (mkdir(path.c_str(), 0777) != 0)
-        {
-            perror("mkdir");
-            std::cout << "Failed to create directory: " << path << std::endl;
-            return false;
-        }
-        else
-        {
-            std::cout << "Directory created: " << path << std::endl;
-        }
+        // Release the path first so the new process can bind its own upgrade socket
+        close(upgradeSocket);
+        unlink(options.upgradeSocketPath.c_str());
+        upgradeSocket = -1;
+        close(serverSocket);
+        serverSocket = -1;
+        handedOff = true;
+        stopSweeper = true; // The new process expires the messages from now on
+        handOffPeer = peer;
+        return true;
     }
-    else
+    close(peer);
+    return false;
+}
+
+// Sends a file descriptor over a UNIX socket (SCM_RIGHTS)
+bool Server::sendFileDescriptor(int unixSocket, int fd)
+{
+    char payload = 'F';
+    struct iovec iov;
+    iov.iov_base = &payload;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    if (sendmsg(unixSocket, &message, 0) == -1)
     {
-        std::cout << "Directory already exists: " << path << std::endl;
+        LOG_ERROR("upgrade.hand_off_failed").field("error", strerror(errno));
+        return false;
     }
-
     return true;
 }
 
-bool Server::directoryExists(const std::string &path)
+// Receives a file descriptor sent with sendFileDescriptor, returns -1 on failure
+int Server::receiveFileDescriptor(int unixSocket)
 {
-    struct stat st = {};
-    return (stat(path.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
-}
+    char payload;
+    struct iovec iov;
+    iov.iov_base = &payload;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    if (recvmsg(unixSocket, &message, 0) <= 0)
+    {
+        LOG_ERROR("upgrade.receive_failed").field("error", strerror(errno));
+        return -1;
+    }
 
-std::string Server::generateMessageFilename(const std::string &dir, const std::string &sender, const std::string &receiver)
-{
-    auto now = std::chrono::system_clock::now();
-    auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == nullptr || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
 
-    // Format the filename with directory, sender, and timestamp
-    std::string filename = dir + "/" + "from_" + sender + "_msg_" + std::to_string(timestamp) + ".txt";
-    return filename;
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    return fd;
 }
 
-// Saves a message to a file with the given filename
-void Server::saveMessage(const std::string &filename, const std::string &message)
+// Thread entry of a client session. An exception ends only this session, not the server;
+// the socket may still be open then.
+void Server::runSession(int clientSocket)
 {
-    std::ofstream outFile(filename);
-    if (outFile.is_open())
+    try
     {
-        outFile << message;
-        outFile.close();
+        handleClientConnection(clientSocket);
     }
-    else
+    catch (const std::exception &error)
     {
-        std::cerr << "Unable to open file: " << filename << std::endl;
+        LOG_ERROR("session.failed").field("socket", clientSocket).field("error", error.what());
+        closeClientConnection(clientSocket);
     }
-}
-
-// Processes the "LIST" command from the client
-void Server::processListCommand(int clientSocket, const std::string &command)
-{
-    std::istringstream iss(command);
-    std::string commandName, username;
-
-    // Extract the command name and username from the command string
-    std::getline(iss, commandName);
-    std::getline(iss, username);
 
-    // Construct the directory path where the user's messages are stored
-    std::string userDir = mailSpoolDir + "/" + username;
-
-    // Check if the user's directory exists
-    if (!directoryExists(userDir))
+    std::lock_guard<std::mutex> guard(sessionLock);
+    if (--activeSessions == 0)
     {
-        send(clientSocket, "ERR User has no inbox\n", 24, 0);
-        return;
+        sessionsDone.notify_all();
     }
+}
 
-    // Retrieve the list of files (messages) in the user's directory
-    std::vector<std::string> files = listFilesInDirectory(userDir);
-
-    // Start building the response with the number of messages
-    std::string response = std::to_string(files.size()) + " Mails found in Inbox of " + username + "\n";
-
-    int messageNumber = 1; // Start message numbering from 1
+// Handles the communication with a connected client
+void Server::handleClientConnection(int clientSocket)
+{
+    LOG_INFO("session.opened").field("socket", clientSocket);
 
-    // Loop through each message file
-    for (const std::string &file : files)
+    // The TLS session ends with the Connection, before its socket is closed
     {
-        // Extract the subject line from each message
-        std::string subject = extractSubjectFromMessage(userDir + "/" + file);
+        Connection connection;
+        connection.socket = clientSocket;
+        connection.transport.attach(clientSocket);
+        connection.buffer.reserve(CONNECTION_BUFFER);
 
-        // Append the message number and subject to the response
-        response += std::to_string(messageNumber++) + ". " + subject + "\n";
+        if ((!tls || tls->accept(connection.transport)) && sendWelcomeMessage(connection))
+        {
+            // Commands already received are always completed; a shutdown only ends idle sessions
+            while (waitForCommand(connection))
+            {
+                if (!processCommand(connection))
+                {
+                    break; // Break the loop if processing results in disconnection
+                }
+            }
+        }
     }
 
-    // Send the compiled response back to the client
-    send(clientSocket, response.c_str(), response.length(), 0);
+    closeClientConnection(clientSocket); // Close the client connection
 }
 
-// Lists files in the given directory and returns their names
-std::vector<std::string> Server::listFilesInDirectory(const std::string &directoryPath)
+// Waits until the client sends data; returns false once the server is shutting down
+bool Server::waitForCommand(Connection &connection)
 {
-    std::vector<std::string> files;
-    DIR *dir = opendir(directoryPath.c_str());
-    struct dirent *entry;
-
-    if (dir != nullptr)
+    while (!isShuttingDown())
     {
-        while ((entry = readdir(dir)) != nullptr)
+        if (connection.nextLine < connection.lines.size() || connection.eof)
         {
-            if (entry->d_type == DT_REG)
-            { // Only include regular files
-                files.push_back(entry->d_name);
-            }
+            return true; // Pipelined commands are already buffered
+        }
+        if (connection.transport.readable(DRAIN_POLL_MS))
+        {
+            return true;
         }
-        closedir(dir);
     }
-    return files;
+    LOG_INFO("session.idle_closed").field("socket", connection.socket);
+    return false;
 }
 
-// Extracts and returns the subject line from a message file.
-std::string Server::extractSubjectFromMessage(const std::string &filePath)
+// Sends the complete response, retrying partial writes and interrupted calls
+bool Server::sendResponse(Connection &connection, const std::string &response)
 {
-    std::ifstream file(filePath);
-    std::string line;
-    std::string subjectPrefix = "Subject: ";
-
-    if (file.is_open())
+    TraceSpan span(TracePhase::Write);
+    if (!connection.transport.sendAll(response))
     {
-        while (getline(file, line))
-        {
-            // Check if the line starts with "Subject: "
-            if (line.find(subjectPrefix) == 0)
-            {
-                return line.substr(subjectPrefix.length());
-            }
-        }
+        LOG_WARNING("session.send_failed").field("socket", connection.socket).field("error", strerror(errno));
+        return false;
     }
-    return "";
+    return true;
 }
 
-// Processes the READ command to send the content of a specific message to the client
-void Server::processReadCommand(int clientSocket, const std::string &command)
+// Sends a welcome message to the connected client
+bool Server::sendWelcomeMessage(Connection &connection)
 {
-    std::istringstream iss(command);
-    std::string commandName, username, messageNumberStr;
-    std::getline(iss, commandName); // This should be "READ"
-    std::getline(iss, username);
-    std::getline(iss, messageNumberStr);
-    int messageNumber = std::stoi(messageNumberStr); // Convert string to int
-
-    std::string userDir = mailSpoolDir + "/" + username;
-    std::vector<std::string> files = listFilesInDirectory(userDir);
+    return sendResponse(connection, "Please choose your command. SEND, LIST, READ, DEL, SEARCH, SYNC, QUOTA, QUIT\n");
+}
 
-    // Validate message number
-    if (messageNumber < 1 || messageNumber > static_cast<int>(files.size()))
+// Returns the next line of the connection. If the buffer fills up without a line break,
+// a piece of the line is returned with complete set to false. The data stays valid
+// until the next call. Returns false once the client disconnected.
+bool Server::readChunk(Connection &connection, const char *&data, size_t &length, bool &complete)
+{
+    while (connection.nextLine == connection.lines.size())
     {
-        send(clientSocket, "ERR\n", 4, 0); // Inform client of invalid message number
-        return;
-    }
+        // Drop what was handed out; only an unfinished line remains
+        connection.buffer.erase(0, connection.scanned);
+        connection.lines.clear();
+        connection.nextLine = 0;
+        connection.scanned = 0;
 
-    // Construct the file path and read the message
-    std::string filename = userDir + "/" + files[messageNumber - 1];
-    std::string messageContent = readFileContent(filename);
+        if (connection.buffer.size() >= CONNECTION_BUFFER || (connection.eof && !connection.buffer.empty()))
+        {
+            // Keep the last byte back while more data may follow, it could start a "\n" escape
+            data = connection.buffer.data();
+            length = connection.eof ? connection.buffer.size() : connection.buffer.size() - 1;
+            complete = connection.eof;
+            connection.scanned = length;
+            return true;
+        }
+        if (connection.eof)
+        {
+            return false;
+        }
 
-    // Send the message content or an error response
-    if (!messageContent.empty())
+        // The timeout lets a client that stalls in the middle of a command hold up a shutdown
+        // only until the drain deadline
+        size_t used = connection.buffer.size();
+        connection.buffer.resize(CONNECTION_BUFFER);
+        ssize_t bytesReceived = connection.transport.recv(&connection.buffer[used], CONNECTION_BUFFER - used, DRAIN_POLL_MS);
+        connection.buffer.resize(used + std::max<ssize_t>(bytesReceived, 0));
+
+        if (bytesReceived == -1 && errno == EAGAIN)
+        {
+            if (drainExpired())
+            {
+                LOG_WARNING("session.drain_timeout").field("socket", connection.socket);
+                return false;
+            }
+            continue;
+        }
+        if (bytesReceived <= 0)
+        {
+            handleReceiveError(bytesReceived);
+            if (bytesReceived == -1)
+            {
+                return false;
+            }
+            connection.eof = true; // A last line without line break is still processed
+            continue;
+        }
+
+        TraceSpan parse(TracePhase::Parse); // Waiting for the client above is not counted as parsing
+        connection.scanned = scanLines(connection.buffer.data(), connection.buffer.size(), connection.lines);
+    }
+
+    const Span &span = connection.lines[connection.nextLine++];
+    data = connection.buffer.data() + span.offset;
+    length = span.length;
+    complete = true;
+    return true;
+}
+
+// Reads a protocol line; lines that do not fit into the receive buffer end the connection
+bool Server::readLine(Connection &connection, std::string &line)
+{
+    const char *data;
+    size_t length;
+    bool complete;
+    if (!readChunk(connection, data, length, complete))
+    {
+        return false;
+    }
+    if (!complete)
+    {
+        LOG_WARNING("session.line_too_long").field("socket", connection.socket);
+        return false;
+    }
+    line.assign(data, length);
+    return true;
+}
+
+// Handles errors that occur during the receive operation
+void Server::handleReceiveError(ssize_t bytesReceived)
+{
+    if (bytesReceived == 0)
+    {
+        LOG_DEBUG("session.peer_closed");
+    }
+    else
+    {
+        LOG_WARNING("session.receive_failed").field("error", strerror(errno));
+    }
+}
+
+// Processes a received command and performs the corresponding action
+bool Server::processCommand(Connection &connection)
+{
+    // Each handler reads the lines of its command from the connection
+    std::string commandName;
+    if (!readLine(connection, commandName))
+    {
+        return false;
+    }
+    if (commandName.empty())
+    {
+        return true; // Ignore blank lines between commands
+    }
+    LOG_DEBUG("command").field("socket", connection.socket).field("name", commandName);
+
+    // Times the command from its first line until the response is sent (--slow-ms, --trace-file);
+    // the idle time before the command does not count
+    RequestTrace trace(connection.socket);
+    trace.name(commandName);
+
+    if (commandName == "SEND" || commandName.compare(0, 5, "SEND ") == 0)
+    {
+        return processSendCommand(connection, commandName.length() > 5 ? commandName.substr(5) : "");
+    }
+    else if (commandName == "LIST")
+    {
+        return processListCommand(connection);
+    }
+    else if (commandName == "READ")
+    {
+        return processReadCommand(connection);
+    }
+    else if (commandName == "DEL")
+    {
+        return processDelCommand(connection);
+    }
+    else if (commandName == "SEARCH")
+    {
+        return processSearchCommand(connection);
+    }
+    else if (commandName == "SYNC")
+    {
+        return processSyncCommand(connection);
+    }
+    else if (commandName == "QUOTA")
+    {
+        return processQuotaCommand(connection);
+    }
+    else if (commandName == "REPLICATE")
+    {
+        trace.cancel(); // A stream that lasts as long as the replica stays connected
+        return processReplicateCommand(connection);
+    }
+    else if (commandName == "QUIT")
+    {
+        return false;
+    }
+    else
+    {
+        LOG_WARNING("command.unknown").field("socket", connection.socket).field("name", commandName);
+    }
+    return true;
+}
+
+// Receives a message and streams its body into a hidden file, which is committed at the "." line.
+// "SEND <ttl>" asks for the message to be deleted after ttl seconds.
+bool Server::processSendCommand(Connection &connection, const std::string &ttl)
+{
+
+    // The command name "SEND" is followed by sender, receiver and subject
+    std::string sender, receiver, subject;
+    if (!readLine(connection, sender) || !readLine(connection, receiver) || !readLine(connection, subject))
+    {
+        return false;
+    }
+
+    if (replica)
+    {
+        sendResponse(connection, "ERR Read-only replica\n");
+        return discardMessageBody(connection, true);
+    }
+
+    int64_t expires = 0;
+    if (!ttl.empty())
+    {
+        char *end;
+        errno = 0;
+        long long seconds = strtoll(ttl.c_str(), &end, 10);
+        if (ttl[0] < '0' || ttl[0] > '9' || errno != 0 || *end != '\0' || seconds <= 0)
+        {
+            sendResponse(connection, "ERR Invalid TTL\n");
+            return discardMessageBody(connection, true);
+        }
+        expires = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count() + seconds;
+    }
+
+    // The sender is part of the message's file name
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(receiver);
+    if (!mailbox || !MailboxStore::isValidUser(sender))
+    {
+        LOG_DEBUG("send.invalid_name").field("sender", sender).field("receiver", receiver);
+        sendResponse(connection, "ERR\n");
+        return discardMessageBody(connection, true);
+    }
+
+    // The mailbox stays on its shard until the message is committed
+    std::unique_lock<std::mutex> guard(mailbox->lock);
+    std::string receiverDir = mailboxes.directory(*mailbox);
+    MailboxUse use(*mailbox);
+
+    // The usage is kept in the index, so a full mailbox is refused before the body is received
+    const Quota &quota = quotaFor(receiver);
+    std::string pending = "Sender: " + sender + "\nReceiver: " + receiver + "\nSubject: " + subject + "\nMessage: ";
+    std::string quotaError;
+    mailboxes.load(*mailbox);
+    if (!checkQuota(*mailbox, quota, pending.length(), quotaError))
+    {
+        guard.unlock();
+        LOG_DEBUG("send.over_quota").field("receiver", receiver);
+        sendResponse(connection, quotaError);
+        return discardMessageBody(connection, true);
+    }
+    uint64_t freeBytes = quota.bytes == 0 ? UINT64_MAX : quota.bytes - mailbox->bytes;
+    guard.unlock();
+
+    // Does the Directory already exists?
+    if (!directoryExists(receiverDir))
+    {
+        // Tries to create the Directory
+        if (!createDirectory(receiverDir))
+        {
+            sendResponse(connection, "ERR\n");
+            return discardMessageBody(connection, true);
+        }
+    }
+
+    // Hidden files are ignored by the mailbox index until they are renamed
+    std::string tempPath = receiverDir + "/.incoming-XXXXXX";
+    int fd;
+    {
+        TraceSpan span(TracePhase::Disk);
+        fd = mkstemp(&tempPath[0]);
+    }
+    if (fd == -1)
+    {
+        LOG_ERROR("send.create_failed").field("path", tempPath).field("error", strerror(errno));
+        sendResponse(connection, "ERR\n");
+        return discardMessageBody(connection, true);
+    }
+
+    // Body lines are written in WRITE_BUFFER sized batches as they arrive and indexed for SEARCH
+    DocumentTerms terms;
+    uint64_t size = pending.length();
+    bool firstLine = true;  // The first body line is followed by an empty line
+    bool atLineStart = true; // Only a whole line can be the terminating "."
+    bool written = true;
+    int writeError = 0; // errno of the failed write; later calls may overwrite errno
+    while (true)
+    {
+        const char *data;
+        size_t length;
+        bool complete;
+        if (!readChunk(connection, data, length, complete))
+        {
+            // Client vanished before the terminator: the message is not delivered
+            close(fd);
+            unlink(tempPath.c_str());
+            return false;
+        }
+        if (atLineStart && complete && length == 1 && data[0] == '.')
+        {
+            break;
+        }
+
+        size += length + (complete ? (firstLine ? 2 : 1) : 0);
+        if (size > options.maxMessageSize)
+        {
+            LOG_DEBUG("send.too_large").field("receiver", receiver).field("limit", options.maxMessageSize);
+            close(fd);
+            unlink(tempPath.c_str());
+            sendResponse(connection, "ERR Message too large\n");
+            return discardMessageBody(connection, complete);
+        }
+        if (size > freeBytes)
+        {
+            // Messages deleted in the meantime may have made room
+            guard.lock();
+            bool fits = checkQuota(*mailbox, quota, size, quotaError);
+            freeBytes = quota.bytes - std::min(mailbox->bytes, quota.bytes);
+            guard.unlock();
+            if (!fits)
+            {
+                LOG_DEBUG("send.over_quota").field("receiver", receiver);
+                close(fd);
+                unlink(tempPath.c_str());
+                sendResponse(connection, quotaError);
+                return discardMessageBody(connection, complete);
+            }
+        }
+
+        pending.append(data, length);
+        if (complete)
+        {
+            pending += firstLine ? "\n\n" : "\n";
+            firstLine = false;
+        }
+        atLineStart = complete;
+
+        if (pending.length() >= WRITE_BUFFER)
+        {
+            terms.feed(pending.data(), pending.length());
+            if (written && !writeAll(fd, pending))
+            {
+                written = false;
+                writeError = errno;
+            }
+            pending.clear();
+        }
+    }
+    if (firstLine)
+    {
+        pending += "\n\n";
+        size += 2;
+    }
+    terms.feed(pending.data(), pending.length());
+
+    // Make the content durable before the message becomes visible; the shard's queue does the fsync
+    if (written && !mailboxes.io(*mailbox).run([&]() { return writeAll(fd, pending) && fsync(fd) == 0; }))
+    {
+        written = false;
+        writeError = errno;
+    }
+    close(fd);
+    if (!written)
+    {
+        LOG_ERROR("send.write_failed").field("path", tempPath).field("error", strerror(writeError));
+        unlink(tempPath.c_str());
+        sendResponse(connection, "ERR\n");
+        return true;
+    }
+
+    // Load the index before the new file appears so it is not indexed twice
+    guard.lock();
+    if (!mailboxes.load(*mailbox))
+    {
+        unlink(tempPath.c_str());
+        sendResponse(connection, "ERR\n");
+        return true;
+    }
+    if (!checkQuota(*mailbox, quota, size, quotaError))
+    {
+        guard.unlock();
+        unlink(tempPath.c_str()); // Another SEND filled the mailbox in the meantime
+        sendResponse(connection, quotaError);
+        return true;
+    }
+    std::string path = generateMessageFilename(receiverDir, sender, receiver);
+    if (!commitMessage(tempPath, path))
+    {
+        unlink(tempPath.c_str());
+        sendResponse(connection, "ERR\n");
+        return true;
+    }
+    mailboxes.addMessage(*mailbox, path.substr(receiverDir.length() + 1), subject, size, terms.finish(), 0, expires);
+    guard.unlock();
+
+    waitForReplicas();
+    sendResponse(connection, "OK\n");
+    return true;
+}
+
+// Skips the rest of a rejected message up to its "." line so the next command is read correctly
+bool Server::discardMessageBody(Connection &connection, bool atLineStart)
+{
+    while (true)
+    {
+        const char *data;
+        size_t length;
+        bool complete;
+        if (!readChunk(connection, data, length, complete))
+        {
+            return false;
+        }
+        if (atLineStart && complete && length == 1 && data[0] == '.')
+        {
+            return true;
+        }
+        atLineStart = complete;
+    }
+}
+
+// Gives the received message its final name, adding a suffix to the path if the name is taken
+bool Server::commitMessage(const std::string &tempPath, std::string &path)
+{
+    TraceSpan span(TracePhase::Disk);
+    std::string base = path.substr(0, path.length() - 4); // Without ".txt"
+    for (int attempt = 1; link(tempPath.c_str(), path.c_str()) != 0; attempt++)
+    {
+        if (errno != EEXIST || attempt > 100)
+        {
+            LOG_ERROR("send.commit_failed").field("path", path).field("error", strerror(errno));
+            return false;
+        }
+        path = base + "_" + std::to_string(attempt) + ".txt";
+    }
+    unlink(tempPath.c_str());
+    return true;
+}
+
+// Writes the whole string to a file descriptor
+bool Server::writeAll(int fd, const std::string &data)
+{
+    TraceSpan span(TracePhase::Disk);
+    size_t written = 0;
+    while (written < data.length())
+    {
+        ssize_t bytes = write(fd, data.data() + written, data.length() - written);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        written += bytes;
+    }
+    return true;
+}
+
+bool Server::createDirectory(const std::string &path)
+{
+    TraceSpan span(TracePhase::Disk);
+    struct stat st = {};
+    if (path.empty())
+    {
+        LOG_ERROR("directory.empty_path");
+        return false;
+    }
+
+    // Check if the directory already exists
+    if (stat(path.c_str(), &st) != 0 || !(st.st_mode & S_IFDIR))
+    {
+        // Attempt to create the directory
+        // Another session may create the same mailbox at the same time
+        if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            LOG_ERROR("directory.create_failed").field("path", path).field("error", strerror(errno));
+            return false;
+        }
+        LOG_INFO("directory.created").field("path", path);
+    }
+    else
+    {
+        LOG_DEBUG("directory.exists").field("path", path);
+    }
+
+    return true;
+}
+
+bool Server::directoryExists(const std::string &path)
+{
+    TraceSpan span(TracePhase::Disk);
+    struct stat st = {};
+    return (stat(path.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+std::string Server::generateMessageFilename(const std::string &dir, const std::string &sender, const std::string &receiver)
+{
+    auto now = std::chrono::system_clock::now();
+    auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+
+    // Format the filename with directory, sender, and timestamp
+    std::string filename = dir + "/" + "from_" + sender + "_msg_" + std::to_string(timestamp) + ".txt";
+    return filename;
+}
+
+// Processes the "LIST" command from the client
+bool Server::processListCommand(Connection &connection)
+{
+
+    // The username follows the command name
+    std::string username;
+    if (!readLine(connection, username))
+    {
+        return false;
+    }
+    if (rejectRead(connection))
+    {
+        return true;
+    }
+
+    // Look up the index of the user's mailbox; the message files are not opened
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(username);
+    if (!mailbox)
+    {
+        sendResponse(connection, "ERR User has no inbox\n");
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    if (!mailboxes.load(*mailbox))
+    {
+        sendResponse(connection, "ERR User has no inbox\n");
+        return true;
+    }
+
+    // Start building the response with the number of messages
+    std::string response = std::to_string(mailbox->entries.size()) + " Mails found in Inbox of " + username + "\n";
+
+    int messageNumber = 1; // Start message numbering from 1
+
+    // Append the message number and subject of each message to the response
+    for (const MailEntry &entry : mailbox->entries)
+    {
+        response += std::to_string(messageNumber++) + ". " + entry.subject + "\n";
+    }
+
+    // Send the compiled response back to the client
+    sendResponse(connection, response);
+    return true;
+}
+
+// Processes the SEARCH command: lists the messages of a user matching all search terms
+bool Server::processSearchCommand(Connection &connection)
+{
+    std::string username, query;
+    if (!readLine(connection, username) || !readLine(connection, query))
+    {
+        return false;
+    }
+    if (rejectRead(connection))
+    {
+        return true;
+    }
+
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(username);
+    if (!mailbox)
+    {
+        sendResponse(connection, "ERR User has no inbox\n");
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    if (!mailboxes.load(*mailbox))
+    {
+        sendResponse(connection, "ERR User has no inbox\n");
+        return true;
+    }
+
+    // Only the first search of a mailbox reads its term journal
+    mailboxes.loadSearch(*mailbox);
+    std::vector<uint32_t> ids = mailbox->search.query(query);
+
+    // Matches are numbered like in LIST so they can be passed to READ and DEL
+    std::string lines;
+    size_t found = 0;
+    for (uint32_t id : ids)
+    {
+        long position = mailboxes.findMessage(*mailbox, id);
+        if (position != -1)
+        {
+            lines += std::to_string(position + 1) + ". " + mailbox->entries[position].subject + "\n";
+            found++;
+        }
+    }
+    sendResponse(connection, std::to_string(found) + " Mails found in Inbox of " + username + "\n" + lines);
+    return true;
+}
+
+// Resolves a message reference of READ or DEL to a position in the mailbox index:
+// either the number shown by LIST or "#<id>" with the message ID reported by SYNC.
+// Returns -1 for invalid or unknown references; the caller holds mailbox.lock.
+long Server::findMessageIndex(Mailbox &mailbox, const std::string &reference)
+{
+    TraceSpan span(TracePhase::Lookup);
+    bool byId = !reference.empty() && reference[0] == '#';
+    const char *digits = reference.c_str() + (byId ? 1 : 0);
+    if (*digits < '0' || *digits > '9')
+    {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(digits, &end, 10);
+    if (errno != 0 || *end != '\0' || value > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    if (byId)
+    {
+        return mailboxes.findMessage(mailbox, value);
+    }
+    if (value < 1 || value > mailbox.entries.size())
+    {
+        return -1;
+    }
+    return value - 1;
+}
+
+// Processes the READ command to send the content of a specific message to the client
+bool Server::processReadCommand(Connection &connection)
+{
+    std::string username, messageNumberStr;
+    if (!readLine(connection, username) || !readLine(connection, messageNumberStr))
+    {
+        return false;
+    }
+    if (rejectRead(connection))
+    {
+        return true;
+    }
+
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(username);
+    if (!mailbox)
+    {
+        sendResponse(connection, "ERR\n");
+        return true;
+    }
+    std::unique_lock<std::mutex> guard(mailbox->lock);
+
+    // Validate message number
+    long index = mailboxes.load(*mailbox) ? findMessageIndex(*mailbox, messageNumberStr) : -1;
+    if (index == -1)
+    {
+        sendResponse(connection, "ERR\n"); // Inform client of invalid message number
+        return true;
+    }
+
+    // Construct the file path and open the message on the shard's I/O queue. An open file
+    // stays readable even if the message is deleted while it is sent.
+    std::string filename = mailboxes.directory(*mailbox) + "/" + mailbox->entries[index].filename;
+    MailboxUse use(*mailbox);
+    guard.unlock();
+    int fd = -1;
+    struct stat info;
+    mailboxes.io(*mailbox).run([&]() {
+        fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &info) != 0 || info.st_size == 0))
+        {
+            close(fd);
+            fd = -1;
+        }
+        return fd != -1;
+    });
+
+    // Send the message content or an error response
+    if (fd == -1)
+    {
+        sendResponse(connection, "ERR\n"); // File reading error
+        return true;
+    }
+
+    // The length lets clients read messages of any content without a terminator. The body
+    // goes from the page cache to the socket without a copy through user space.
+    bool sent;
+    {
+        TraceSpan span(TracePhase::Write);
+        sent = connection.transport.sendAll("OK " + std::to_string(info.st_size) + "\n", true) &&
+               connection.transport.sendFile(fd, info.st_size);
+    }
+    close(fd);
+    if (!sent)
+    {
+        LOG_WARNING("session.send_failed").field("socket", connection.socket).field("error", strerror(errno));
+        return false; // The response is cut short, so the connection cannot continue
+    }
+    return true;
+}
+
+// Processes the SYNC command: reports the messages added and removed since the client's
+// sync token, or the whole index if the token is empty, unknown or too old
+bool Server::processSyncCommand(Connection &connection)
+{
+    std::string username, token;
+    if (!readLine(connection, username) || !readLine(connection, token))
+    {
+        return false;
+    }
+    if (rejectRead(connection))
+    {
+        return true;
+    }
+
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(username);
+    if (!mailbox)
+    {
+        sendResponse(connection, "ERR User has no inbox\n");
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    if (!mailboxes.load(*mailbox))
+    {
+        sendResponse(connection, "ERR User has no inbox\n");
+        return true;
+    }
+
+    // Added messages are described like in LIST, removed ones only by their ID
+    std::string lines;
+    size_t count = 0;
+    std::vector<MailChange> changes;
+    bool delta = mailboxes.changesSince(*mailbox, token, changes);
+    if (delta)
+    {
+        // Only the last change of each message matters
+        std::map<uint32_t, bool> latest;
+        for (const MailChange &change : changes)
+        {
+            latest[change.id] = change.added;
+        }
+        for (const auto &change : latest)
+        {
+            long position = change.second ? mailboxes.findMessage(*mailbox, change.first) : -1;
+            if (position != -1)
+            {
+                const MailEntry &entry = mailbox->entries[position];
+                lines += "+" + std::to_string(entry.id) + "\t" + std::to_string(entry.size) + "\t" + entry.subject + "\n";
+            }
+            else
+            {
+                lines += "-" + std::to_string(change.first) + "\n";
+            }
+            count++;
+        }
+    }
+    else
+    {
+        for (const MailEntry &entry : mailbox->entries)
+        {
+            lines += "+" + std::to_string(entry.id) + "\t" + std::to_string(entry.size) + "\t" + entry.subject + "\n";
+        }
+        count = mailbox->entries.size();
+    }
+
+    std::string header = std::string(delta ? "DELTA " : "FULL ") + mailboxes.syncToken(*mailbox) + " " + std::to_string(count) + "\n";
+    sendResponse(connection, header + lines);
+    return true;
+}
+
+// Reads the per-user limits: one "<user> <messages> <bytes>" line per user, 0 for unlimited.
+// Empty lines and lines starting with '#' are ignored.
+bool Server::loadQuotas()
+{
+    std::ifstream file(options.quotaFile);
+    if (!file.is_open())
+    {
+        std::cerr << "Error opening quota file: " << options.quotaFile << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++)
+    {
+        std::istringstream fields(line);
+        std::string user;
+        Quota quota;
+        if (!(fields >> user) || user[0] == '#')
+        {
+            continue;
+        }
+        if (!(fields >> quota.messages >> quota.bytes))
+        {
+            std::cerr << "Invalid quota in " << options.quotaFile << " line " << number << ": " << line << std::endl;
+            return false;
+        }
+        userQuotas[user] = quota;
+    }
+    return true;
+}
+
+const Quota &Server::quotaFor(const std::string &user)
+{
+    auto it = userQuotas.find(user);
+    return it != userQuotas.end() ? it->second : options.quota;
+}
+
+// Checks whether a message of the given size still fits into the mailbox and describes the
+// exceeded limit in error otherwise; the caller holds mailbox.lock
+bool Server::checkQuota(const Mailbox &mailbox, const Quota &quota, uint64_t size, std::string &error)
+{
+    if (quota.messages != 0 && mailbox.entries.size() >= quota.messages)
+    {
+        error = "ERR Quota exceeded: " + std::to_string(mailbox.entries.size()) + " of " +
+                std::to_string(quota.messages) + " messages\n";
+        return false;
+    }
+    if (quota.bytes != 0 && (mailbox.bytes >= quota.bytes || size > quota.bytes - mailbox.bytes))
+    {
+        error = "ERR Quota exceeded: " + std::to_string(mailbox.bytes) + " of " + std::to_string(quota.bytes) +
+                " bytes used\n";
+        return false;
+    }
+    return true;
+}
+
+static std::string quotaLimit(uint64_t limit)
+{
+    return limit == 0 ? "unlimited" : std::to_string(limit);
+}
+
+// Processes the QUOTA command: reports the usage of a mailbox and its limits,
+// "OK messages=<count>/<limit> bytes=<bytes>/<limit>"
+bool Server::processQuotaCommand(Connection &connection)
+{
+    std::string username;
+    if (!readLine(connection, username))
+    {
+        return false;
+    }
+    if (rejectRead(connection))
+    {
+        return true;
+    }
+
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(username);
+    if (!mailbox)
+    {
+        sendResponse(connection, "ERR\n");
+        return true;
+    }
+
+    // A user without a mailbox has not used anything yet
+    const Quota &quota = quotaFor(username);
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    mailboxes.load(*mailbox);
+    sendResponse(connection, "OK messages=" + std::to_string(mailbox->entries.size()) + "/" +
+                                   quotaLimit(quota.messages) + " bytes=" + std::to_string(mailbox->bytes) + "/" +
+                                   quotaLimit(quota.bytes) + "\n");
+    return true;
+}
+
+// Reads the per-user retention: one "<user> <max-age>" line per user in seconds, 0 to keep
+// the messages. Empty lines and lines starting with '#' are ignored.
+bool Server::loadRetention()
+{
+    std::ifstream file(options.retentionFile);
+    if (!file.is_open())
+    {
+        std::cerr << "Error opening retention file: " << options.retentionFile << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++)
+    {
+        std::istringstream fields(line);
+        std::string user;
+        int64_t maxAge;
+        if (!(fields >> user) || user[0] == '#')
+        {
+            continue;
+        }
+        if (!(fields >> maxAge) || maxAge < 0)
+        {
+            std::cerr << "Invalid max age in " << options.retentionFile << " line " << number << ": " << line << std::endl;
+            return false;
+        }
+        userMaxAges[user] = maxAge;
+    }
+    return true;
+}
+
+// Deletes expired messages in the background, taking them from the time-ordered expiry queue
+// of the mailbox store instead of scanning the spool. At most --sweep-rate messages are
+// deleted per second, in batches every SWEEP_INTERVAL_MS, so a large backlog does not
+// compete with the sessions for the disks. Rates below one message per interval are kept
+// as a fractional budget that builds up over several intervals.
+// Deadlines are only queued once a mailbox is loaded, so the budget left after the deletions
+// loads the mailboxes that neither the warm-up nor a command has loaded yet, one per message.
+void Server::runSweeper()
+{
+    double perInterval = options.sweepRate * SWEEP_INTERVAL_MS / 1000.0;
+    double budget = 0;
+    size_t expired = 0;
+    std::vector<std::string> unloaded = mailboxes.users();
+    size_t nextUnloaded = 0;
+    size_t loadedMailboxes = 0;
+    while (!stopSweeper && !isShuttingDown())
+    {
+        budget = std::min(budget + perInterval, std::max(perInterval, 1.0));
+        size_t batch = static_cast<size_t>(budget);
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::vector<Expiry> due = batch > 0 ? mailboxes.takeExpired(now, batch) : std::vector<Expiry>();
+        budget -= due.size();
+
+        // Each mailbox is locked once per batch
+        std::map<std::string, std::vector<Expiry>> byUser;
+        for (const Expiry &expiry : due)
+        {
+            byUser[expiry.user].push_back(expiry);
+        }
+        for (const auto &user : byUser)
+        {
+            expired += expireMessages(user.first, user.second, now);
+        }
+
+        if (batch > 0 && due.size() < batch && expired > 0)
+        {
+            LOG_INFO("retention.swept").field("deleted", expired);
+            expired = 0;
+        }
+
+        while (budget >= 1 && nextUnloaded < unloaded.size() && !stopSweeper)
+        {
+            std::shared_ptr<Mailbox> mailbox = mailboxes.get(unloaded[nextUnloaded++]);
+            if (mailbox)
+            {
+                std::lock_guard<std::mutex> guard(mailbox->lock);
+                if (!mailbox->loaded)
+                {
+                    mailboxes.load(*mailbox);
+                    budget -= 1;
+                    loadedMailboxes++;
+                }
+            }
+            if (nextUnloaded == unloaded.size() && loadedMailboxes > 0)
+            {
+                LOG_INFO("retention.mailboxes_loaded").field("mailboxes", loadedMailboxes);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(SWEEP_INTERVAL_MS));
+    }
+}
+
+// Deletes the given messages of a user that are still there, with one job on the shard's
+// I/O queue; returns the number of deleted messages. Messages that could not be deleted are
+// queued again with a growing delay.
+size_t Server::expireMessages(const std::string &user, const std::vector<Expiry> &due, int64_t now)
+{
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(user);
+    if (!mailbox)
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(mailbox->lock);
+    if (!mailboxes.load(*mailbox))
+    {
+        return 0;
+    }
+
+    // Messages deleted with DEL are still in the expiry queue
+    std::vector<Expiry> present;
+    std::vector<std::string> files;
+    for (const Expiry &expiry : due)
+    {
+        long position = mailboxes.findMessage(*mailbox, expiry.id);
+        if (position != -1)
+        {
+            present.push_back(expiry);
+            files.push_back(mailboxes.directory(*mailbox) + "/" + mailbox->entries[position].filename);
+        }
+    }
+    if (present.empty())
+    {
+        return 0;
+    }
+
+    // errno of each failed removal, 0 for a removed file
+    std::vector<int> errors(files.size(), 0);
+    mailboxes.io(*mailbox).run([&]() {
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (remove(files[i].c_str()) != 0 && errno != ENOENT)
+            {
+                errors[i] = errno;
+            }
+        }
+        return true;
+    });
+
+    size_t count = 0;
+    for (size_t i = 0; i < present.size(); i++)
+    {
+        if (errors[i] != 0)
+        {
+            Expiry retry = present[i];
+            int64_t delay = std::min<int64_t>(int64_t(1) << std::min(retry.attempts, 12u), SWEEP_RETRY_MAX_S);
+            retry.deadline = now + delay;
+            retry.attempts++;
+            mailboxes.requeueExpiry(retry);
+            LOG_ERROR("retention.delete_failed").field("path", files[i]).field("error", strerror(errors[i]))
+                .field("retry_in", delay);
+            continue;
+        }
+        mailboxes.removeMessage(*mailbox, mailboxes.findMessage(*mailbox, present[i].id));
+        count++;
+    }
+    return count;
+}
+
+// A replica only answers while it is in sync with the primary up to --max-lag records
+bool Server::rejectRead(Connection &connection)
+{
+    if (replica && !replica->readable(options.maxLag))
+    {
+        sendResponse(connection, "ERR Replica is behind the primary\n");
+        return true;
+    }
+    return false;
+}
+
+// Bounds the replication lag: a change is confirmed once every connected replica is at most
+// --max-lag records behind it. A replica that stops responding delays changes by at most
+// REPLICA_WAIT_MS each; it stops reading once it is behind.
+void Server::waitForReplicas()
+{
+    if (changeLog)
+    {
+        changeLog->waitForReplicas(changeLog->lastSeq(), options.maxLag, REPLICA_WAIT_MS);
+    }
+}
+
+// Reads a message file for a replica; the mailbox stays on its shard while the file is read
+bool Server::readMessageForReplica(const std::string &user, const std::string &filename, std::string &content)
+{
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(user);
+    if (!mailbox)
+    {
+        return false;
+    }
+    std::unique_lock<std::mutex> guard(mailbox->lock);
+    std::string path = mailboxes.directory(*mailbox) + "/" + filename;
+    MailboxUse use(*mailbox);
+    guard.unlock();
+    mailboxes.io(*mailbox).run([&]() {
+        content = readFileContent(path);
+        return true;
+    });
+    return !content.empty();
+}
+
+// Sends all messages as they are now. Changes made while the snapshot is taken are also
+// in the stream that follows it; the replica skips the ones it already has.
+bool Server::sendSnapshot(Connection &connection, uint64_t &seq)
+{
+    seq = changeLog->lastSeq();
+    if (!sendResponse(connection, "SNAPSHOT " + changeLog->id() + " " + std::to_string(seq) + "\n"))
+    {
+        return false;
+    }
+
+    std::string batch;
+    for (const std::string &user : mailboxes.users())
+    {
+        std::shared_ptr<Mailbox> mailbox = mailboxes.get(user);
+        std::vector<MailEntry> entries;
+        {
+            std::lock_guard<std::mutex> guard(mailbox->lock);
+            if (mailboxes.load(*mailbox))
+            {
+                entries = mailbox->entries;
+            }
+        }
+
+        for (const MailEntry &entry : entries)
+        {
+            std::string content;
+            if (!readMessageForReplica(user, entry.filename, content))
+            {
+                continue; // Deleted meanwhile
+            }
+            batch += "FILE 0 " + user + " " + std::to_string(entry.id) + " " + std::to_string(content.size()) + "\t" +
+                     entry.filename + "\t" + entry.subject + "\n" + content;
+            if (batch.size() >= WRITE_BUFFER)
+            {
+                if (!sendResponse(connection, batch))
+                {
+                    return false;
+                }
+                batch.clear();
+            }
+        }
+    }
+    return sendResponse(connection, batch + "END\n");
+}
+
+// Turns the connection into a replication stream: after an optional snapshot the replica
+// receives every change log record after its position and acknowledges what it applied.
+bool Server::processReplicateCommand(Connection &connection)
+{
+    std::string logId, position;
+    if (!readLine(connection, logId) || !readLine(connection, position))
+    {
+        return false;
+    }
+    if (!changeLog)
+    {
+        sendResponse(connection, "ERR Not a primary\n");
+        return true;
+    }
+
+    uint64_t seq = strtoull(position.c_str(), nullptr, 10);
+    std::vector<ReplicationRecord> records;
+    bool streaming;
+    if (logId != changeLog->id() || !changeLog->readSince(seq, records, 0))
     {
-        std::string response = "OK\n" + messageContent + "\n";
-        send(clientSocket, response.c_str(), response.length(), 0);
+        LOG_INFO("replication.replica_connected").field("socket", connection.socket).field("snapshot", "yes");
+        streaming = sendSnapshot(connection, seq);
     }
     else
     {
-        send(clientSocket, "ERR\n", 4, 0); // File reading error
+        LOG_INFO("replication.replica_connected").field("socket", connection.socket).field("seq", seq);
+        streaming = sendResponse(connection, "STREAM " + changeLog->id() + " " + std::to_string(seq) + "\n");
+    }
+    changeLog->acknowledge(connection.socket, seq);
+
+    while (streaming && !isShuttingDown())
+    {
+        // Acknowledgements from the replica
+        while (streaming && (connection.nextLine < connection.lines.size() || connection.transport.readable(0)))
+        {
+            std::string line;
+            streaming = readLine(connection, line);
+            if (streaming && line.compare(0, 4, "ACK ") == 0)
+            {
+                changeLog->acknowledge(connection.socket, strtoull(line.c_str() + 4, nullptr, 10));
+            }
+        }
+
+        records.clear();
+        if (!streaming || !changeLog->readSince(seq, records, REPLICATION_BATCH))
+        {
+            break; // Fell out of the log; the replica reconnects and gets a snapshot
+        }
+        if (records.empty())
+        {
+            changeLog->waitForRecords(seq, REPLICA_PING_MS);
+            if (changeLog->lastSeq() == seq)
+            {
+                streaming = sendResponse(connection, "PING " + std::to_string(seq) + "\n");
+            }
+            continue;
+        }
+
+        std::string batch;
+        for (const ReplicationRecord &record : records)
+        {
+            std::string content;
+            if (!record.added)
+            {
+                batch += "DEL " + std::to_string(record.seq) + " " + record.user + " " + std::to_string(record.id) + "\n";
+            }
+            else if (readMessageForReplica(record.user, record.filename, content))
+            {
+                batch += "SEND " + std::to_string(record.seq) + " " + record.user + " " + std::to_string(record.id) + " " +
+                         std::to_string(content.size()) + "\t" + record.filename + "\t" + record.subject + "\n" + content;
+            }
+            else
+            {
+                batch += "SKIP " + std::to_string(record.seq) + "\n"; // Deleted since; its DEL follows
+            }
+            seq = record.seq;
+        }
+        streaming = sendResponse(connection, batch);
     }
+
+    changeLog->removeReplica(connection.socket);
+    LOG_INFO("replication.replica_disconnected").field("socket", connection.socket).field("seq", seq);
+    return false;
 }
 
 // Reads and returns the content of a file given its path
@@ -465,64 +1797,253 @@ std::string Server::readFileContent(const std::string &filePath)
 }
 
 // Processes the DEL command to delete a specific message for a user
-void Server::processDelCommand(int clientSocket, const std::string &command)
+bool Server::processDelCommand(Connection &connection)
 {
-    std::istringstream iss(command);
-    std::string commandName, username, messageNumberStr;
-    std::getline(iss, commandName); // This should be "DEL"
-    std::getline(iss, username);
-    std::getline(iss, messageNumberStr);
-    int messageNumber = std::stoi(messageNumberStr); // Convert string to int
+    std::string username, messageNumberStr;
+    if (!readLine(connection, username) || !readLine(connection, messageNumberStr))
+    {
+        return false;
+    }
+
+    if (replica)
+    {
+        sendResponse(connection, "ERR Read-only replica\n");
+        return true;
+    }
 
-    std::string userDir = mailSpoolDir + "/" + username;
-    std::vector<std::string> files = listFilesInDirectory(userDir);
+    std::shared_ptr<Mailbox> mailbox = mailboxes.get(username);
+    if (!mailbox)
+    {
+        sendResponse(connection, "ERR\n");
+        return true;
+    }
+    std::unique_lock<std::mutex> guard(mailbox->lock);
 
     // Validate message number
-    if (messageNumber < 1 || messageNumber > static_cast<ssize_t>(files.size()))
+    long index = mailboxes.load(*mailbox) ? findMessageIndex(*mailbox, messageNumberStr) : -1;
+    if (index == -1)
     {
-        send(clientSocket, "ERR\n", 4, 0); // Inform client of invalid message number
-        return;
+        sendResponse(connection, "ERR\n"); // Inform client of invalid message number
+        return true;
     }
 
     // Determine the file to delete and attempt deletion
-    std::string fileToDelete = userDir + "/" + files[messageNumber - 1];
-    if (remove(fileToDelete.c_str()) != 0)
+    std::string fileToDelete = mailboxes.directory(*mailbox) + "/" + mailbox->entries[index].filename;
+    bool removed;
     {
-        perror("Error deleting file");
-        send(clientSocket, "ERR\n", 4, 0); // Notify client of deletion error
+        TraceSpan span(TracePhase::Disk);
+        removed = remove(fileToDelete.c_str()) == 0;
+    }
+    if (!removed)
+    {
+        LOG_ERROR("del.remove_failed").field("path", fileToDelete).field("error", strerror(errno));
+        sendResponse(connection, "ERR\n"); // Notify client of deletion error
     }
     else
     {
-        send(clientSocket, "OK\n", 3, 0); // Confirm successful deletion
+        mailboxes.removeMessage(*mailbox, index);
+        guard.unlock();
+        waitForReplicas();
+        sendResponse(connection, "OK\n"); // Confirm successful deletion
     }
+    return true;
 }
 
 // Closes the client's connection
 void Server::closeClientConnection(int clientSocket)
 {
+    {
+        // The drain must not shut down a descriptor that was reused after the close
+        std::lock_guard<std::mutex> guard(sessionLock);
+        sessionSockets.erase(clientSocket);
+    }
     close(clientSocket);
-    std::cout << "Client connection closed.\n";
+    LOG_INFO("session.closed").field("socket", clientSocket);
+}
+
+// The drivers in tests/ link the server without its main
+#ifndef TWMAILER_NO_MAIN
+// Parses a thread count; std::stoul would turn "-1" into a huge value instead of failing
+static unsigned parseCount(const std::string &text)
+{
+    if (text.find('-') != std::string::npos) // Also " -1", as std::stoul skips leading spaces
+    {
+        throw std::invalid_argument(text);
+    }
+    unsigned long value = std::stoul(text);
+    if (value > UINT_MAX)
+    {
+        throw std::invalid_argument(text);
+    }
+    return static_cast<unsigned>(value);
 }
 
 int main(int argc, char *argv[])
 {
 
-    // Display correct usage for the Client
-    if (argc != 3)
+    const char *usage = "Usage: ./twmailer-server <port> <mail-spool-directoryname> [--upgrade-socket <path>] [--takeover] [--drain-timeout <seconds>] [--warmup-threads <n>] [--max-message-size <bytes>] [--shard <dir>]... [--io-threads <n>] [--primary | --replica-of <host:port>] [--max-lag <records>] [--quota-messages <n>] [--quota-bytes <bytes>] [--quota-file <path>] [--max-age <seconds>] [--retention-file <path>] [--sweep-rate <n>] [--tls-cert <file> --tls-key <file>] [--replica-tls] [--tls-ca <file>] [--log-level <level>] [--log-format kv|json] [--log-file <path>] [--slow-ms <ms>] [--trace-file <path>]\n";
+
+    // Display correct usage for the Server
+    if (argc < 3)
     {
-        std::cerr << "Usage: ./twmailer-server <port> <mail-spool-directoryname>\n";
+        std::cerr << usage;
         return EXIT_FAILURE;
     }
 
     // Extract the port and mail spool directory
-    int port = std::stoi(argv[1]);
+    int port;
     std::string mailSpoolDir = argv[2];
+    ServerOptions options;
+    LogOptions logOptions;
+    TraceOptions traceOptions;
+    try
+    {
+        port = std::stoi(argv[1]);
+
+        // Optional flags follow the positional arguments
+        for (int i = 3; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--upgrade-socket" && i + 1 < argc)
+            {
+                options.upgradeSocketPath = argv[++i];
+            }
+            else if (arg == "--takeover")
+            {
+                options.takeover = true;
+            }
+            else if (arg == "--drain-timeout" && i + 1 < argc)
+            {
+                options.drainTimeout = std::stoul(argv[++i]);
+            }
+            else if (arg == "--warmup-threads" && i + 1 < argc)
+            {
+                options.warmupThreads = parseCount(argv[++i]);
+            }
+            else if (arg == "--shard" && i + 1 < argc)
+            {
+                options.shards.push_back(argv[++i]);
+            }
+            else if (arg == "--primary")
+            {
+                options.primary = true;
+            }
+            else if (arg == "--replica-of" && i + 1 < argc)
+            {
+                options.replicaOf = argv[++i];
+            }
+            else if (arg == "--max-lag" && i + 1 < argc)
+            {
+                options.maxLag = std::stoull(argv[++i]);
+            }
+            else if (arg == "--io-threads" && i + 1 < argc)
+            {
+                options.ioThreads = parseCount(argv[++i]);
+            }
+            else if (arg == "--quota-messages" && i + 1 < argc)
+            {
+                options.quota.messages = std::stoull(argv[++i]);
+            }
+            else if (arg == "--quota-bytes" && i + 1 < argc)
+            {
+                options.quota.bytes = std::stoull(argv[++i]);
+            }
+            else if (arg == "--quota-file" && i + 1 < argc)
+            {
+                options.quotaFile = argv[++i];
+            }
+            else if (arg == "--max-age" && i + 1 < argc)
+            {
+                options.maxAge = std::stoll(argv[++i]);
+            }
+            else if (arg == "--retention-file" && i + 1 < argc)
+            {
+                options.retentionFile = argv[++i];
+            }
+            else if (arg == "--sweep-rate" && i + 1 < argc)
+            {
+                options.sweepRate = std::stoul(argv[++i]);
+            }
+            else if (arg == "--tls-cert" && i + 1 < argc)
+            {
+                options.tlsCert = argv[++i];
+            }
+            else if (arg == "--tls-key" && i + 1 < argc)
+            {
+                options.tlsKey = argv[++i];
+            }
+            else if (arg == "--replica-tls")
+            {
+                options.replicaTls = true;
+            }
+            else if (arg == "--tls-ca" && i + 1 < argc)
+            {
+                options.tlsCa = argv[++i];
+                options.replicaTls = true;
+            }
+            else if (arg == "--log-level" && i + 1 < argc && Log::parseLevel(argv[i + 1], logOptions.level))
+            {
+                i++;
+            }
+            else if (arg == "--log-format" && i + 1 < argc &&
+                     (std::string(argv[i + 1]) == "kv" || std::string(argv[i + 1]) == "json"))
+            {
+                logOptions.json = std::string(argv[++i]) == "json";
+            }
+            else if (arg == "--log-file" && i + 1 < argc)
+            {
+                logOptions.path = argv[++i];
+            }
+            else if (arg == "--slow-ms" && i + 1 < argc)
+            {
+                traceOptions.slowMicros = std::stoull(argv[++i]) * 1000;
+            }
+            else if (arg == "--trace-file" && i + 1 < argc)
+            {
+                traceOptions.path = argv[++i];
+            }
+            else if (arg == "--max-message-size" && i + 1 < argc)
+            {
+                options.maxMessageSize = std::stoull(argv[++i]);
+            }
+            else
+            {
+                std::cerr << usage;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    catch (const std::logic_error &)
+    {
+        // Numbers that do not parse (std::invalid_argument, std::out_of_range)
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+
+    if (options.primary && !options.replicaOf.empty())
+    {
+        std::cerr << "A server is either --primary or --replica-of another one\n";
+        return EXIT_FAILURE;
+    }
+    if (options.tlsCert.empty() != options.tlsKey.empty())
+    {
+        std::cerr << "--tls-cert and --tls-key are given together\n";
+        return EXIT_FAILURE;
+    }
+
+    // Records are written by a background thread from here on, and at exit
+    if (!Log::start(logOptions) || !RequestTrace::configure(traceOptions))
+    {
+        return EXIT_FAILURE;
+    }
 
     // Create mail server
-    Server mailServer(port, mailSpoolDir);
+    Server mailServer(port, mailSpoolDir, options);
 
     // Start listening for client connections
     mailServer.startListening();
+    RequestTrace::finish();
 
     return EXIT_SUCCESS;
 }
+#endif
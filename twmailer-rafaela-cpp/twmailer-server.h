@@ -9,40 +9,129 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <fstream>
 #include <chrono>
 #include <vector>
 #include <dirent.h>
 #include <map>
+#include <set>
+#include <cerrno>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "twmailer-mailbox.h"
+#include "twmailer-replication.h"
+#include "twmailer-scanner.h"
+#include "twmailer-tls.h"
+#include "twmailer-log.h"
+#include "twmailer-trace.h"
+
+// Limits of one mailbox; 0 means unlimited
+struct Quota {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+};
+
+// Optional runtime settings passed on the command line
+struct ServerOptions {
+    std::string upgradeSocketPath; // UNIX socket used to hand the listening socket to a new process
+    bool takeover = false;         // Take the listening socket over from a running server instead of binding
+    unsigned drainTimeout = 30;    // Seconds sessions get to finish after SIGTERM before they are cut off
+    unsigned warmupThreads = std::thread::hardware_concurrency(); // Threads loading the mailbox indexes at startup
+    uint64_t maxMessageSize = 10 * 1024 * 1024; // Larger messages are rejected while they are received
+    std::vector<std::string> shards; // Spool roots in addition to the mail spool directory
+    unsigned ioThreads = 4;          // Disk operations in flight per shard
+    bool primary = false;            // Keep a change log and serve REPLICATE to replicas
+    std::string replicaOf;           // host:port of the primary this server replicates (read-only)
+    uint64_t maxLag = 1000;          // Change log records a replica may fall behind
+    Quota quota;                     // Default limits of every mailbox
+    std::string quotaFile;           // Per-user limits overriding the default
+    int64_t maxAge = 0;              // Seconds messages are kept, 0 to keep them
+    std::string retentionFile;       // Per-user max ages overriding the default
+    unsigned sweepRate = 100;        // Expired messages deleted per second at most
+    std::string tlsCert;             // Certificate chain; with a key the listener only accepts TLS
+    std::string tlsKey;
+    bool replicaTls = false;         // Connect to the primary with TLS
+    std::string tlsCa;               // CAs trusted for the primary's certificate besides the system ones
+};
+
+// Receive state of a client connection. The buffer has a fixed size; lines longer
+// than the buffer are handed out in pieces.
+struct Connection {
+    int socket;
+    std::string buffer;      // Received bytes, including lines already handed out
+    std::vector<Span> lines; // Complete lines found in the buffer
+    size_t nextLine = 0;     // First line not handed out yet
+    size_t scanned = 0;      // Bytes covered by `lines` or by a handed out piece
+    bool eof = false;        // The client closed its side of the connection
+    TlsSocket transport;     // All sends and receives of the session go through it
+};
 
 class Server {
 public:
-    Server(int port, std::string mailSpoolDir);
+    Server(int port, std::string mailSpoolDir, const ServerOptions& options = ServerOptions());
     ~Server();
 
     void startListening(); // Start listening for client connections
 
+    // Serves one client session on the calling thread, e.g. over one end of a socketpair;
+    // used by the fuzz and stress drivers in tests/
+    void serveConnection(int clientSocket);
+
 private:
     int createServerSocket();
     void bindServerSocket();
     void listenForConnections();
     int acceptClientConnection();
+    void installSignalHandlers();
+    int takeOverListeningSocket();
+    int createUpgradeSocket();
+    bool handOffListeningSocket();
+    bool sendFileDescriptor(int unixSocket, int fd);
+    int receiveFileDescriptor(int unixSocket);
+    bool isShuttingDown();
+    bool drainExpired();
+    void drainSessions();
+    bool waitForCommand(Connection& connection);
+    bool readChunk(Connection& connection, const char*& data, size_t& length, bool& complete);
+    bool readLine(Connection& connection, std::string& line);
+    bool sendResponse(Connection& connection, const std::string& response);
+    void runSession(int clientSocket);
     void handleClientConnection(int clientSocket);
     void closeClientConnection(int clientSocket);
-    bool processCommand(int clientSocket, const std::string& command);
-    bool processSendCommand(int clientSocket, const std::string &command);
-    void processListCommand(int clientSocket, const std::string& command);
-    void processReadCommand(int clientSocket, const std::string& command);
-    void processDelCommand(int clientSocket, const std::string& command);
+    bool processCommand(Connection& connection);
+    bool processSendCommand(Connection& connection, const std::string& ttl);
+    bool processListCommand(Connection& connection);
+    bool processReadCommand(Connection& connection);
+    bool processDelCommand(Connection& connection);
+    bool processSearchCommand(Connection& connection);
+    bool processSyncCommand(Connection& connection);
+    bool processQuotaCommand(Connection& connection);
+    bool loadQuotas();
+    const Quota& quotaFor(const std::string& user);
+    bool checkQuota(const Mailbox& mailbox, const Quota& quota, uint64_t size, std::string& error);
+    bool loadRetention();
+    void runSweeper();
+    size_t expireMessages(const std::string& user, const std::vector<Expiry>& due, int64_t now);
+    bool processReplicateCommand(Connection& connection);
+    bool sendSnapshot(Connection& connection, uint64_t& seq);
+    bool readMessageForReplica(const std::string& user, const std::string& filename, std::string& content);
+    bool rejectRead(Connection& connection);
+    void waitForReplicas();
+    long findMessageIndex(Mailbox& mailbox, const std::string& reference);
+    bool discardMessageBody(Connection& connection, bool atLineStart);
+    bool commitMessage(const std::string& tempPath, std::string& path);
+    bool writeAll(int fd, const std::string& data);
     bool createDirectory(const std::string& path);
     std::string generateMessageFilename(const std::string& dir, const std::string& sender, const std::string& receiver);
-    void saveMessage(const std::string& filename, const std::string& message);
-    std::vector<std::string> listFilesInDirectory(const std::string& directoryPath);
-    std::string extractSubjectFromMessage(const std::string& filePath);
     std::string readFileContent(const std::string& filePath);
-    void replaceBackslashNWithNewline(std::string &str);
-    bool sendWelcomeMessage(int clientSocket);
-    std::string receiveCommand(int clientSocket);
+    bool sendWelcomeMessage(Connection& connection);
     void handleReceiveError(ssize_t bytesReceived);
     bool directoryExists(const std::string& path);
     std::map<std::string, int> messageCounters;
@@ -50,12 +139,29 @@ private:
 
 private:
     int serverSocket;
+    int upgradeSocket;
+    int handOffPeer;                 // Connection to the new process, closed once this one stopped using the spool
+    std::atomic<bool> handedOff;
     int port;
+    ServerOptions options;
     std::string mailSpoolDir;
+    MailboxStore mailboxes;
+    std::unique_ptr<TlsContext> tls;        // Only with --tls-cert and --tls-key
+    std::unique_ptr<TlsContext> replicaTls; // Only on a replica with --replica-tls
+    std::unique_ptr<ChangeLog> changeLog; // Only on a primary
+    std::unique_ptr<Replica> replica;     // Only on a replica
+    std::map<std::string, Quota> userQuotas; // From --quota-file
+    std::map<std::string, int64_t> userMaxAges; // From --retention-file
+    std::thread sweeperThread;
+    std::atomic<bool> stopSweeper{false};
+    std::mutex sessionLock;
+    std::condition_variable sessionsDone;
+    unsigned activeSessions = 0; // Client sessions still running on their threads
+    std::set<int> sessionSockets; // Their sockets, shut down when the drain deadline passes
+    std::atomic<int64_t> drainDeadline{INT64_MAX}; // Steady clock milliseconds; set once the server stops accepting
     std::string sender;
     std::string receiver;
     std::string subject;
-    std::string message;
     
 };
 
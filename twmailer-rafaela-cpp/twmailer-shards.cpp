@@ -0,0 +1,255 @@
+#include "twmailer-shards.h"
+#include "twmailer-log.h"
+#include "twmailer-trace.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MANIFEST_NAME ".shards"
+#define VIRTUAL_NODES 128 // Points per shard on the ring; more points spread the users more evenly
+
+// FNV-1a, stable across builds and platforms unlike std::hash. Short names that differ
+// only in the last characters end up close together, so the result is mixed afterwards
+// (MurmurHash3 finalizer) to spread them over the whole ring.
+static uint32_t hashName(const std::string &name)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static std::string canonicalPath(const std::string &path)
+{
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) == nullptr)
+    {
+        return path;
+    }
+    return resolved;
+}
+
+ShardMap::ShardMap()
+{
+}
+
+bool ShardMap::open(const std::vector<std::string> &configured)
+{
+    std::vector<std::string> wanted;
+    for (const std::string &root : configured)
+    {
+        wanted.push_back(canonicalPath(root));
+    }
+    manifestPath = wanted[0] + "/" MANIFEST_NAME;
+
+    // Manifest lines: "shard <root>" in ring order, "move <user> <shard>" for pinned users
+    std::ifstream manifest(manifestPath);
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "shard")
+        {
+            std::string root;
+            std::getline(fields >> std::ws, root);
+            if (std::find(wanted.begin(), wanted.end(), root) == wanted.end())
+            {
+                std::cerr << "Shard " << root << " is listed in " << manifestPath << " but not configured\n";
+                return false;
+            }
+            roots.push_back(root);
+        }
+        else if (kind == "move")
+        {
+            std::string user;
+            unsigned shard;
+            if (fields >> user >> shard)
+            {
+                pins[user] = shard;
+            }
+        }
+    }
+
+    // New shards take their place on the ring after the known ones
+    for (const std::string &root : wanted)
+    {
+        if (std::find(roots.begin(), roots.end(), root) == roots.end())
+        {
+            if (!roots.empty())
+            {
+                LOG_INFO("shards.added").field("shard", roots.size()).field("root", root);
+            }
+            roots.push_back(root);
+        }
+    }
+
+    for (auto it = pins.begin(); it != pins.end();)
+    {
+        it = it->second < roots.size() ? std::next(it) : pins.erase(it);
+    }
+
+    // Points are derived from the shard number, so moving a shard to another path keeps its users
+    for (unsigned shard = 0; shard < roots.size(); shard++)
+    {
+        for (unsigned point = 0; point < VIRTUAL_NODES; point++)
+        {
+            ring.push_back(std::make_pair(hashName(std::to_string(shard) + "-" + std::to_string(point)), shard));
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+    return save();
+}
+
+size_t ShardMap::size() const
+{
+    return roots.size();
+}
+
+const std::string &ShardMap::root(unsigned shard) const
+{
+    return roots[shard];
+}
+
+// The user belongs to the first point at or after its hash, wrapping around
+unsigned ShardMap::placement(const std::string &user) const
+{
+    auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(hashName(user), 0u));
+    return it != ring.end() ? it->second : ring.front().second;
+}
+
+unsigned ShardMap::locate(const std::string &user)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = pins.find(user);
+    return it != pins.end() ? it->second : placement(user);
+}
+
+void ShardMap::pin(const std::string &user, unsigned shard)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (shard == placement(user))
+    {
+        pins.erase(user);
+    }
+    else
+    {
+        pins[user] = shard;
+    }
+}
+
+std::vector<std::pair<std::string, unsigned>> ShardMap::pending()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return std::vector<std::pair<std::string, unsigned>>(pins.begin(), pins.end());
+}
+
+// Written to a temporary file and renamed, so a crash leaves either the old or the new manifest
+bool ShardMap::save()
+{
+    std::string content;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const std::string &root : roots)
+        {
+            content += "shard " + root + "\n";
+        }
+        for (const auto &pin : pins)
+        {
+            content += "move " + pin.first + " " + std::to_string(pin.second) + "\n";
+        }
+    }
+
+    std::string tempPath = manifestPath + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd != -1 && write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()) &&
+              fsync(fd) == 0;
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (!ok || rename(tempPath.c_str(), manifestPath.c_str()) != 0)
+    {
+        LOG_ERROR("shards.manifest_write_failed").field("path", manifestPath).field("error", strerror(errno));
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+IoQueue::IoQueue(unsigned threads) : stopping(false)
+{
+    for (unsigned i = 0; i < std::max(threads, 1u); i++)
+    {
+        workers.push_back(std::thread(&IoQueue::work, this));
+    }
+}
+
+IoQueue::~IoQueue()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+// The time in the queue counts as disk time of the current request, like the job itself
+bool IoQueue::run(const std::function<bool()> &job)
+{
+    TraceSpan span(TracePhase::Disk);
+    Job entry = {&job, false, 0, false};
+    std::unique_lock<std::mutex> guard(lock);
+    jobs.push_back(&entry);
+    queued.notify_one();
+    finished.wait(guard, [&entry]() { return entry.done; });
+    errno = entry.error; // errno is per thread; the job ran on the worker's
+    return entry.result;
+}
+
+void IoQueue::work()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        queued.wait(guard, [this]() { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+        {
+            return; // Stopping and nothing left to do
+        }
+        Job *job = jobs.front();
+        jobs.pop_front();
+
+        guard.unlock();
+        errno = 0;
+        bool result = (*job->work)();
+        int error = errno;
+        guard.lock();
+
+        job->result = result;
+        job->error = error;
+        job->done = true;
+        finished.notify_all();
+    }
+}
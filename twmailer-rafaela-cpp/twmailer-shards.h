@@ -0,0 +1,82 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdint>
+
+// Maps users to spool roots (shards) with a consistent hash ring.
+// The manifest <first root>/.shards records the shards in the order they were added,
+// which fixes their positions on the ring, and the users that still live on another
+// shard than the ring assigns them to because they were not moved yet.
+class ShardMap {
+public:
+    ShardMap();
+
+    // Reads the manifest; configured roots that are not listed yet are added as new shards.
+    // Fails if a shard of the manifest is not configured any more.
+    bool open(const std::vector<std::string>& roots);
+
+    size_t size() const;
+    const std::string& root(unsigned shard) const;
+
+    // Shard the ring assigns to a user
+    unsigned placement(const std::string& user) const;
+
+    // Shard that holds the user's mailbox right now
+    unsigned locate(const std::string& user);
+
+    // Records that a user's mailbox is on the given shard; forgets it once that is the placement
+    void pin(const std::string& user, unsigned shard);
+
+    // Users waiting to be moved to their placement, with their current shard
+    std::vector<std::pair<std::string, unsigned>> pending();
+
+    bool save();
+
+private:
+    std::vector<std::string> roots;
+    std::vector<std::pair<uint32_t, unsigned>> ring; // Sorted (hash, shard) points
+    std::string manifestPath;
+    std::mutex lock;
+    std::map<std::string, unsigned> pins;
+};
+
+// Runs the disk operations of one shard on its own worker threads, so each disk
+// gets its own queue and a slow disk does not hold up the others. The number of
+// workers bounds the number of operations in flight per disk.
+class IoQueue {
+public:
+    explicit IoQueue(unsigned threads);
+    ~IoQueue();
+
+    // Runs the job on a worker of this queue and waits for its result. errno is set to the
+    // value the job left on the worker thread, so a failure can be reported by the caller.
+    bool run(const std::function<bool()>& job);
+
+private:
+    struct Job {
+        const std::function<bool()>* work;
+        bool result;
+        int error; // errno after the job
+        bool done;
+    };
+
+    void work();
+
+    std::mutex lock;
+    std::condition_variable queued;
+    std::condition_variable finished;
+    std::deque<Job*> jobs;
+    bool stopping;
+    std::vector<std::thread> workers;
+};
+
+#endif // SHARDS_H
@@ -0,0 +1,510 @@
+#include "twmailer-tls.h"
+#include "twmailer-log.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#ifdef TWMAILER_TLS
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+#define HANDSHAKE_TIMEOUT_MS 10000 // A peer that does not finish its handshake in time is dropped
+#define FILE_CHUNK 65536           // Bytes read at a time when a file is encrypted in user space
+
+TlsSocket::TlsSocket() : socket(-1)
+{
+#ifdef TWMAILER_TLS
+    ssl = nullptr;
+    ktlsSend = false;
+#endif
+}
+
+TlsSocket::~TlsSocket()
+{
+    end();
+}
+
+void TlsSocket::end()
+{
+#ifdef TWMAILER_TLS
+    if (ssl != nullptr)
+    {
+        // Tell the peer the session ended; the socket is non-blocking, so this never waits
+        std::lock_guard<std::mutex> guard(lock);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        ssl = nullptr;
+        ktlsSend = false;
+    }
+#endif
+}
+
+void TlsSocket::attach(int socket)
+{
+    TlsSocket::socket = socket;
+}
+
+int TlsSocket::fd() const
+{
+    return socket;
+}
+
+bool TlsSocket::secure() const
+{
+#ifdef TWMAILER_TLS
+    return ssl != nullptr;
+#else
+    return false;
+#endif
+}
+
+bool TlsSocket::kernelTls() const
+{
+#ifdef TWMAILER_TLS
+    return ktlsSend;
+#else
+    return false;
+#endif
+}
+
+// Waits for the socket to become ready; false on timeout or interruption
+bool TlsSocket::wait(short events, int timeoutMs)
+{
+    struct pollfd fds = {socket, events, 0};
+    return poll(&fds, 1, timeoutMs) > 0;
+}
+
+ssize_t TlsSocket::send(const char *data, size_t length, bool more)
+{
+#ifdef TWMAILER_TLS
+    if (ssl != nullptr)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            int bytes = SSL_write(ssl, data, length);
+            if (bytes > 0)
+            {
+                return bytes;
+            }
+            int error = SSL_get_error(ssl, bytes);
+            if (error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ)
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            guard.unlock();
+            wait(error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN, -1);
+            guard.lock();
+        }
+    }
+#endif
+    ssize_t bytes;
+    do
+    {
+        bytes = ::send(socket, data, length, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    } while (bytes == -1 && errno == EINTR);
+    return bytes;
+}
+
+ssize_t TlsSocket::recv(char *data, size_t length, int timeoutMs)
+{
+#ifdef TWMAILER_TLS
+    if (ssl != nullptr)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            int bytes = SSL_read(ssl, data, length);
+            if (bytes > 0)
+            {
+                return bytes;
+            }
+            int error = SSL_get_error(ssl, bytes);
+            if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && errno == 0))
+            {
+                return 0; // Closed by the peer
+            }
+            if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+            {
+                errno = ECONNRESET;
+                return -1;
+            }
+            // Another thread may send while this one waits for the next record
+            guard.unlock();
+            if (!wait(error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, timeoutMs) && timeoutMs >= 0)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            guard.lock();
+        }
+    }
+#endif
+    // With a timeout the data already there is taken without a poll() first
+    ssize_t bytes;
+    while (true)
+    {
+        bytes = ::recv(socket, data, length, timeoutMs >= 0 ? MSG_DONTWAIT : 0);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes == -1 && errno == EAGAIN && timeoutMs >= 0)
+        {
+            if (!wait(POLLIN, timeoutMs))
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+        return bytes;
+    }
+}
+
+bool TlsSocket::sendAll(const std::string &data, bool more)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t bytes = send(data.data() + sent, data.size() - sent, more);
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        sent += bytes;
+    }
+    return true;
+}
+
+bool TlsSocket::sendFile(int fileFd, uint64_t length)
+{
+    off_t offset = 0;
+#ifdef TWMAILER_TLS
+    if (ssl != nullptr && ktlsSend)
+    {
+        // The kernel encrypts, so the pages go from the page cache to the socket directly
+        std::unique_lock<std::mutex> guard(lock);
+        while (static_cast<uint64_t>(offset) < length)
+        {
+            ossl_ssize_t bytes = SSL_sendfile(ssl, fileFd, offset, length - offset, 0);
+            if (bytes > 0)
+            {
+                offset += bytes;
+                continue;
+            }
+            int error = SSL_get_error(ssl, bytes);
+            if (error != SSL_ERROR_WANT_WRITE)
+            {
+                return false;
+            }
+            guard.unlock();
+            wait(POLLOUT, -1);
+            guard.lock();
+        }
+        return true;
+    }
+    if (ssl != nullptr)
+    {
+        char buffer[FILE_CHUNK];
+        while (static_cast<uint64_t>(offset) < length)
+        {
+            ssize_t bytes = pread(fileFd, buffer, std::min<uint64_t>(sizeof(buffer), length - offset), offset);
+            if (bytes <= 0 || !sendAll(std::string(buffer, bytes)))
+            {
+                return false;
+            }
+            offset += bytes;
+        }
+        return true;
+    }
+#endif
+    while (static_cast<uint64_t>(offset) < length)
+    {
+        ssize_t bytes = sendfile(socket, fileFd, &offset, length - offset);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TlsSocket::readable(int timeoutMs)
+{
+#ifdef TWMAILER_TLS
+    if (ssl != nullptr)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (SSL_pending(ssl) > 0)
+        {
+            return true;
+        }
+    }
+#endif
+    return wait(POLLIN, timeoutMs);
+}
+
+TlsContext::TlsContext()
+    : fullHandshakes(0), resumedHandshakes(0), fullNanoseconds(0), resumedNanoseconds(0), kernelTlsSessions(0)
+{
+#ifdef TWMAILER_TLS
+    context = nullptr;
+    session = nullptr;
+#endif
+}
+
+TlsContext::~TlsContext()
+{
+#ifdef TWMAILER_TLS
+    if (session != nullptr)
+    {
+        SSL_SESSION_free(session);
+    }
+    if (context != nullptr)
+    {
+        SSL_CTX_free(context);
+    }
+#endif
+}
+
+bool TlsContext::available()
+{
+#ifdef TWMAILER_TLS
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef TWMAILER_TLS
+static void logTlsError(const char *event)
+{
+    unsigned long code = ERR_get_error();
+    char reason[256] = "unknown error";
+    if (code != 0)
+    {
+        ERR_error_string_n(code, reason, sizeof(reason));
+    }
+    ERR_clear_error();
+    LOG_ERROR(event).field("reason", reason);
+}
+
+// Options shared by servers and clients
+static SSL_CTX *createContext(const SSL_METHOD *method)
+{
+    SSL_CTX *context = SSL_CTX_new(method);
+    if (context == nullptr)
+    {
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Kernel TLS is used where the kernel and the cipher support it and ignored otherwise
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    return context;
+}
+
+// Keeps the newest session ticket of a client for the next connection
+int TlsContext::storeSession(SSL *ssl, SSL_SESSION *session)
+{
+    TlsContext *self = static_cast<TlsContext *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    std::lock_guard<std::mutex> guard(self->sessionLock);
+    if (self->session != nullptr)
+    {
+        SSL_SESSION_free(self->session);
+    }
+    self->session = session;
+    return 1; // The session is ours now
+}
+#endif
+
+bool TlsContext::initServer(const std::string &certFile, const std::string &keyFile)
+{
+#ifdef TWMAILER_TLS
+    context = createContext(TLS_server_method());
+    if (context == nullptr || SSL_CTX_use_certificate_chain_file(context, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1)
+    {
+        logTlsError("tls.certificate_failed");
+        return false;
+    }
+
+    // Resumption: TLS 1.3 session tickets, and the session cache for TLS 1.2 clients
+    static const unsigned char sessionContext[] = "twmailer";
+    SSL_CTX_set_session_id_context(context, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    return true;
+#else
+    (void)certFile;
+    (void)keyFile;
+    std::cerr << "Built without TLS support (build with make TLS=1)" << std::endl;
+    return false;
+#endif
+}
+
+bool TlsContext::initClient(const std::string &caFile)
+{
+#ifdef TWMAILER_TLS
+    context = createContext(TLS_client_method());
+    if (context == nullptr || SSL_CTX_set_default_verify_paths(context) != 1 ||
+        (!caFile.empty() && SSL_CTX_load_verify_locations(context, caFile.c_str(), nullptr) != 1))
+    {
+        logTlsError("tls.ca_failed");
+        return false;
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+
+    // Tickets arrive after the handshake; the callback keeps the newest one
+    SSL_CTX_set_app_data(context, this);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context, storeSession);
+    return true;
+#else
+    (void)caFile;
+    std::cerr << "Built without TLS support (build with make TLS=1)" << std::endl;
+    return false;
+#endif
+}
+
+bool TlsContext::accept(TlsSocket &socket)
+{
+    return handshake(socket, true);
+}
+
+bool TlsContext::connect(TlsSocket &socket, const std::string &host)
+{
+#ifdef TWMAILER_TLS
+    SSL *ssl = SSL_new(context);
+    if (ssl == nullptr)
+    {
+        return false;
+    }
+
+    // Certificates name either the IP address or the host name
+    struct in_addr address;
+    if (inet_pton(AF_INET, host.c_str(), &address) == 1)
+    {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str());
+    }
+    else
+    {
+        SSL_set1_host(ssl, host.c_str());
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+    }
+    {
+        std::lock_guard<std::mutex> guard(sessionLock);
+        if (session != nullptr)
+        {
+            SSL_set_session(ssl, session);
+        }
+    }
+    socket.ssl = ssl;
+#else
+    (void)host;
+#endif
+    return handshake(socket, false);
+}
+
+#ifdef TWMAILER_TLS
+static uint64_t threadCpuNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+#endif
+
+// Runs the handshake on the non-blocking socket. Only the CPU time of this thread is
+// counted, not the time spent waiting for the peer.
+bool TlsContext::handshake(TlsSocket &socket, bool server)
+{
+#ifdef TWMAILER_TLS
+    SSL *ssl = server ? SSL_new(context) : socket.ssl;
+    socket.ssl = nullptr;
+    if (ssl == nullptr || SSL_set_fd(ssl, socket.socket) != 1)
+    {
+        SSL_free(ssl);
+        return false;
+    }
+    fcntl(socket.socket, F_SETFL, fcntl(socket.socket, F_GETFL) | O_NONBLOCK);
+
+    uint64_t cpuStarted = threadCpuNanoseconds();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+    while (true)
+    {
+        int result = server ? SSL_accept(ssl) : SSL_connect(ssl);
+        if (result == 1)
+        {
+            break;
+        }
+        int error = SSL_get_error(ssl, result);
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if ((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || remaining.count() <= 0 ||
+            !socket.wait(error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, remaining.count()))
+        {
+            logTlsError("tls.handshake_failed");
+            SSL_free(ssl);
+            return false;
+        }
+    }
+
+    uint64_t cpu = threadCpuNanoseconds() - cpuStarted;
+    if (SSL_session_reused(ssl))
+    {
+        resumedHandshakes++;
+        resumedNanoseconds += cpu;
+    }
+    else
+    {
+        fullHandshakes++;
+        fullNanoseconds += cpu;
+    }
+    socket.ssl = ssl;
+    socket.ktlsSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    if (socket.ktlsSend)
+    {
+        kernelTlsSessions++;
+    }
+    return true;
+#else
+    (void)socket;
+    (void)server;
+    return false;
+#endif
+}
+
+std::string TlsContext::statistics()
+{
+    uint64_t full = fullHandshakes;
+    uint64_t resumed = resumedHandshakes;
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << full + resumed << " TLS handshakes (" << resumed << " resumed), "
+         << (fullNanoseconds + resumedNanoseconds) / 1e6 << " ms CPU";
+    if (full > 0)
+    {
+        text << ", " << fullNanoseconds / 1e6 / full << " ms per full";
+    }
+    if (resumed > 0)
+    {
+        text << ", " << resumedNanoseconds / 1e6 / resumed << " ms per resumed";
+    }
+    text << ", kernel TLS on " << kernelTlsSessions << " connections";
+    return text.str();
+}
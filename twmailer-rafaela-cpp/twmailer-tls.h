@@ -0,0 +1,101 @@
+#ifndef TLS_H
+#define TLS_H
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+
+#ifdef TWMAILER_TLS
+#include <openssl/ssl.h>
+#endif
+
+// A connected socket, optionally with TLS on top. Without a handshake (or in a build
+// without TWMAILER_TLS) the calls go straight to the socket. With TLS the socket is
+// non-blocking and every call on the TLS session is serialized, so one thread may
+// send while another one receives.
+class TlsSocket {
+public:
+    TlsSocket();
+    ~TlsSocket();
+    TlsSocket(const TlsSocket&) = delete;
+    TlsSocket& operator=(const TlsSocket&) = delete;
+
+    // Uses a connected socket; the caller keeps closing it
+    void attach(int socket);
+
+    // Ends the TLS session with a close notification, done by the destructor otherwise.
+    // Must happen before the socket is closed.
+    void end();
+    int fd() const;
+    bool secure() const;
+    bool kernelTls() const; // Records are encrypted by the kernel, so sendFile is zero-copy
+
+    // Like send() and recv(). recv waits at most timeoutMs (-1: no limit) and fails with EAGAIN then.
+    ssize_t send(const char* data, size_t length, bool more = false);
+    ssize_t recv(char* data, size_t length, int timeoutMs = -1);
+
+    // Sends everything, retrying partial writes; `more` announces that more data follows right away
+    bool sendAll(const std::string& data, bool more = false);
+
+    // Sends length bytes of a file from its start: sendfile() on plain sockets and with kernel TLS,
+    // read and encrypted in user space otherwise
+    bool sendFile(int fileFd, uint64_t length);
+
+    // True if data can be received without blocking longer than timeoutMs. Decrypted data
+    // buffered by TLS counts, which a poll() on the socket does not see.
+    bool readable(int timeoutMs);
+
+private:
+    friend class TlsContext;
+    bool wait(short events, int timeoutMs);
+
+    int socket;
+#ifdef TWMAILER_TLS
+    SSL* ssl;
+    std::mutex lock;
+    bool ktlsSend;
+#endif
+};
+
+// TLS settings of the process: the certificate of the server, or the trusted CAs and the
+// session kept for resumption of a client. Counts the handshakes and their CPU time.
+class TlsContext {
+public:
+    TlsContext();
+    ~TlsContext();
+
+    static bool available(); // Built with TWMAILER_TLS
+
+    bool initServer(const std::string& certFile, const std::string& keyFile);
+
+    // Servers are verified against the system CAs and caFile if given
+    bool initClient(const std::string& caFile);
+
+    // Runs the handshake on an attached socket; false if it failed or timed out
+    bool accept(TlsSocket& socket);
+    bool connect(TlsSocket& socket, const std::string& host);
+
+    // "<n> handshakes (<r> resumed), <ms> ms CPU ..." for summaries
+    std::string statistics();
+
+private:
+    bool handshake(TlsSocket& socket, bool server);
+
+#ifdef TWMAILER_TLS
+    static int storeSession(SSL* ssl, SSL_SESSION* session);
+
+    SSL_CTX* context;
+    std::mutex sessionLock;
+    SSL_SESSION* session; // Latest session ticket of a client, offered on the next connect
+#endif
+    std::atomic<uint64_t> fullHandshakes;
+    std::atomic<uint64_t> resumedHandshakes;
+    std::atomic<uint64_t> fullNanoseconds;    // Thread CPU time of full handshakes
+    std::atomic<uint64_t> resumedNanoseconds; // Thread CPU time of resumed handshakes
+    std::atomic<uint64_t> kernelTlsSessions;
+};
+
+#endif // TLS_H
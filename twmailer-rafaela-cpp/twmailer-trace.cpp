@@ -0,0 +1,221 @@
+#include "twmailer-trace.h"
+#include "twmailer-log.h"
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TRACE_MAX_SPANS 256        // Spans kept per request for the trace file; time is counted for all
+#define TRACE_FLUSH_BYTES 65536    // Trace events collected before they are written
+
+static const char *phaseNames[] = {"other", "parse", "lookup", "disk", "write"};
+
+static TraceOptions settings;
+static bool tracing = false;   // Set before the sessions start, read-only afterwards
+static bool traceFile = false; // Spans are kept for the trace file
+static thread_local RequestTrace *currentTrace = nullptr;
+static std::chrono::steady_clock::time_point epoch; // Trace timestamps count from here
+static std::string processId;
+
+static std::mutex fileLock;
+static int traceFd = -1;
+static std::string pending; // Trace events not written yet
+static bool firstEvent = true;
+
+static uint64_t microsBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+static void writePending()
+{
+    size_t written = 0;
+    while (written < pending.size())
+    {
+        ssize_t bytes = write(traceFd, pending.data() + written, pending.size() - written);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            LOG_ERROR("trace.write_failed").field("path", settings.path).field("error", strerror(errno));
+            break;
+        }
+        written += bytes;
+    }
+    pending.clear();
+}
+
+// A complete event ("ph":"X") with its start and duration in microseconds
+static void appendEvent(std::string &out, const char *name, const char *category, int socket,
+                        std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end,
+                        const std::string &args)
+{
+    out += firstEvent ? "\n" : ",\n";
+    firstEvent = false;
+    out += "{\"name\":\"";
+    out += name;
+    out += "\",\"cat\":\"";
+    out += category;
+    out += "\",\"ph\":\"X\",\"pid\":" + processId + ",\"tid\":" + std::to_string(socket) + ",\"ts\":" +
+           std::to_string(microsBetween(epoch, start)) + ",\"dur\":" + std::to_string(microsBetween(start, end));
+    if (!args.empty())
+    {
+        out += ",\"args\":{" + args + "}";
+    }
+    out += "}";
+}
+
+bool RequestTrace::configure(const TraceOptions &options)
+{
+    settings = options;
+    epoch = Clock::now();
+    processId = std::to_string(getpid());
+    if (!options.path.empty())
+    {
+        traceFd = open(options.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (traceFd == -1)
+        {
+            perror("Error opening trace file");
+            return false;
+        }
+        pending = "[";
+        traceFile = true;
+    }
+    tracing = options.slowMicros > 0 || traceFile;
+    return true;
+}
+
+void RequestTrace::finish()
+{
+    std::lock_guard<std::mutex> guard(fileLock);
+    if (traceFd != -1)
+    {
+        pending += "\n]\n";
+        writePending();
+        close(traceFd);
+        traceFd = -1;
+    }
+}
+
+RequestTrace::RequestTrace(int socket)
+    : active(tracing && currentTrace == nullptr), socket(socket), phase(TracePhase::Other)
+{
+    if (active)
+    {
+        started = switched = Clock::now();
+        memset(micros, 0, sizeof(micros));
+        currentTrace = this;
+    }
+}
+
+// The first word of the command line; names not made of capitals are reported as "unknown"
+void RequestTrace::name(const std::string &command)
+{
+    if (active)
+    {
+        RequestTrace::command = command.substr(0, command.find(' '));
+        if (RequestTrace::command.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ") != std::string::npos)
+        {
+            RequestTrace::command = "unknown";
+        }
+    }
+}
+
+void RequestTrace::cancel()
+{
+    if (active)
+    {
+        active = false;
+        currentTrace = nullptr;
+    }
+}
+
+// Counts the time since the last switch for the phase that ends and returns it
+TracePhase RequestTrace::enter(TracePhase next, Clock::time_point now)
+{
+    micros[static_cast<int>(phase)] += microsBetween(switched, now);
+    switched = now;
+    TracePhase left = phase;
+    phase = next;
+    return left;
+}
+
+RequestTrace::~RequestTrace()
+{
+    if (!active)
+    {
+        return;
+    }
+    currentTrace = nullptr;
+    Clock::time_point ended = Clock::now();
+    enter(TracePhase::Other, ended);
+
+    uint64_t total = microsBetween(started, ended);
+    if (settings.slowMicros > 0 && total >= settings.slowMicros)
+    {
+        LOG_INFO("request.slow")
+            .field("command", command)
+            .field("socket", socket)
+            .field("total_us", total)
+            .field("parse_us", micros[static_cast<int>(TracePhase::Parse)])
+            .field("lookup_us", micros[static_cast<int>(TracePhase::Lookup)])
+            .field("disk_us", micros[static_cast<int>(TracePhase::Disk)])
+            .field("write_us", micros[static_cast<int>(TracePhase::Write)])
+            .field("other_us", micros[static_cast<int>(TracePhase::Other)]);
+    }
+
+    if (!traceFile)
+    {
+        return;
+    }
+    std::string args;
+    for (int i = 0; i < 5; i++)
+    {
+        args += std::string(i > 0 ? "," : "") + "\"" + phaseNames[i] + "_us\":" + std::to_string(micros[i]);
+    }
+    std::lock_guard<std::mutex> guard(fileLock);
+    if (traceFd == -1)
+    {
+        return; // Finished already, the server is going away
+    }
+    appendEvent(pending, command.c_str(), "request", socket, started, ended, args);
+    for (const Span &span : spans)
+    {
+        appendEvent(pending, phaseNames[static_cast<int>(span.phase)], "phase", socket, span.start, span.end, "");
+    }
+    if (pending.size() >= TRACE_FLUSH_BYTES)
+    {
+        writePending();
+    }
+}
+
+TraceSpan::TraceSpan(TracePhase phase) : trace(currentTrace), previous(TracePhase::Other), index(SIZE_MAX)
+{
+    if (trace != nullptr)
+    {
+        RequestTrace::Clock::time_point now = RequestTrace::Clock::now();
+        previous = trace->enter(phase, now);
+        if (traceFile && trace->spans.size() < TRACE_MAX_SPANS)
+        {
+            index = trace->spans.size();
+            trace->spans.push_back(RequestTrace::Span{phase, now, now});
+        }
+    }
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (trace != nullptr && currentTrace == trace)
+    {
+        RequestTrace::Clock::time_point now = RequestTrace::Clock::now();
+        trace->enter(previous, now);
+        if (index != SIZE_MAX)
+        {
+            trace->spans[index].end = now;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+// Where the time of a request goes. Other is everything not covered by a span, mostly
+// the command's own CPU work and waiting for mailbox locks.
+enum class TracePhase { Other, Parse, Lookup, Disk, Write };
+
+struct TraceOptions {
+    uint64_t slowMicros = 0; // Requests taking at least this long are logged with their breakdown; 0 = off
+    std::string path;        // Chrome trace (JSON array of trace events) written here; empty = off
+};
+
+// Timing of one command on a session thread, from its first line until the response
+// is sent. While it exists it is the current trace of its thread, so the spans in the
+// mailbox store, the I/O queues and the socket code find it without being passed along.
+// Does nothing unless tracing was configured.
+class RequestTrace {
+public:
+    explicit RequestTrace(int socket);
+    ~RequestTrace(); // Logs the request if slow and adds it to the trace file
+    RequestTrace(const RequestTrace&) = delete;
+    RequestTrace& operator=(const RequestTrace&) = delete;
+
+    void name(const std::string& command);
+    void cancel(); // Not a request, e.g. a replication stream
+
+    static bool configure(const TraceOptions& options);
+    static void finish(); // Completes the trace file
+
+private:
+    friend class TraceSpan;
+    typedef std::chrono::steady_clock Clock;
+
+    struct Span {
+        TracePhase phase;
+        Clock::time_point start;
+        Clock::time_point end;
+    };
+
+    TracePhase enter(TracePhase phase, Clock::time_point now);
+
+    bool active;
+    int socket;
+    std::string command;
+    Clock::time_point started;
+    Clock::time_point switched; // When the current phase was entered
+    TracePhase phase;
+    uint64_t micros[5];        // Exclusive time per phase
+    std::vector<Span> spans;   // Only kept for the trace file
+};
+
+// Attributes the time until the end of the scope to a phase of the current request.
+// Spans nest: the time of an inner span is not counted for the outer one.
+class TraceSpan {
+public:
+    explicit TraceSpan(TracePhase phase);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    RequestTrace* trace;
+    TracePhase previous;
+    size_t index;
+};
+
+#endif // TRACE_H